@@ -0,0 +1,38 @@
+import { CoapMethod, CoapRequest } from '../src/NabtoDevice/NabtoDevice';
+import { BenchResult, latencySummary, nowMs, withLoopback } from './harness';
+
+// Round trips of GET requests answered straight from the handler, with a fixed number in flight.
+export async function coapRequests(count: number, concurrency: number): Promise<BenchResult> {
+  return withLoopback(async (lb) => {
+    lb.dev.addCoapEndpoint(CoapMethod.GET, '/bench/{n}', (req: CoapRequest) => {
+      req.respond(205);
+    });
+    let conn = await lb.start();
+
+    let latencies: number[] = [];
+    let next = 0;
+    let worker = async () => {
+      while (next < count) {
+        let n = next++;
+        let start = nowMs();
+        let resp = await conn.createCoapRequest("GET", `/bench/${n}`).execute();
+        latencies.push(nowMs() - start);
+        if (resp.getResponseStatusCode() != 205) {
+          throw new Error(`Unexpected status ${resp.getResponseStatusCode()}`);
+        }
+      }
+    };
+
+    let start = nowMs();
+    await Promise.all(Array.from({length: concurrency}, worker));
+    let elapsed = nowMs() - start;
+
+    return {
+      name: "coap.requests",
+      params: {count, concurrency},
+      unit: "req/s",
+      value: count / (elapsed / 1000),
+      ...latencySummary(latencies),
+    };
+  });
+}
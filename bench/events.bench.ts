@@ -0,0 +1,47 @@
+import { ConnectionEvent } from '../src/NabtoDevice/NabtoDevice';
+import { BenchResult, nowMs, withLoopback } from './harness';
+
+// Connections opened and closed in rounds of `concurrency`, counting the OPENED
+// and CLOSED connection events delivered to JS.
+export async function connectionEvents(count: number, concurrency: number): Promise<BenchResult> {
+  return withLoopback(async (lb) => {
+    let delivered = 0;
+    let onEvent: () => void = () => {};
+    lb.dev.onConnectionEvent((ev: ConnectionEvent) => {
+      if (ev == ConnectionEvent.OPENED || ev == ConnectionEvent.CLOSED) {
+        delivered++;
+        onEvent();
+      }
+    });
+    await lb.start();
+    // The connection made by start() has delivered its OPENED event once connect() resolves on both sides.
+    await waitFor(() => delivered >= 1, (fn) => onEvent = fn);
+    let base = delivered;
+
+    let start = nowMs();
+    for (let done = 0; done < count; done += concurrency) {
+      let round = Math.min(concurrency, count - done);
+      let conns = Array.from({length: round}, () => lb.createConnection());
+      await Promise.all(conns.map((c) => c.connect()));
+      await Promise.all(conns.map((c) => c.close().catch(() => {})));
+      let target = base + 2 * (done + round);
+      await waitFor(() => delivered >= target, (fn) => onEvent = fn);
+    }
+    let elapsed = nowMs() - start;
+
+    return {
+      name: "events.connection",
+      params: {count, concurrency},
+      unit: "events/s",
+      value: (delivered - base) / (elapsed / 1000),
+    };
+  });
+}
+
+function waitFor(cond: () => boolean, setNotify: (fn: () => void) => void): Promise<void> {
+  return new Promise<void>((resolve) => {
+    let check = () => { if (cond()) resolve(); };
+    setNotify(check);
+    check();
+  });
+}
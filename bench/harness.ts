@@ -0,0 +1,100 @@
+import { env } from 'process';
+import { Connection, NabtoClient, NabtoClientFactory } from 'edge-client-node'
+import { DeviceOptions, LogMessage, NabtoDevice, NabtoDeviceFactory } from '../src/NabtoDevice/NabtoDevice';
+
+const logLevel = env.NABTO_LOG_LEVEL;
+
+// One measurement. Results are emitted as JSON so runs from different commits can be compared by name.
+export interface BenchResult {
+  name: string;
+  params: {[key: string]: number | string};
+  unit: string;
+  value: number;
+  [extra: string]: any;
+}
+
+// A device and a local client connection to it, set up the same way as in the tests.
+export class Loopback {
+  dev: NabtoDevice;
+  cli: NabtoClient | undefined;
+  conn: Connection | undefined;
+
+  constructor() {
+    this.dev = NabtoDeviceFactory.create();
+    let opts: DeviceOptions = {
+        productId: "pr-foobar",
+        deviceId: "de-foobar",
+        privateKey: this.dev.createPrivateKey(),
+        enableMdns: true,
+        localPort: 0,
+        p2pPort: 0,
+    }
+    this.dev.setOptions(opts);
+    if (logLevel) {
+      this.dev.setLogLevel(logLevel);
+      this.dev.setLogCallback((logMessage: LogMessage) => {
+        console.error(`[dev] ${new Date().toISOString()} [${logMessage.severity}]: ${logMessage.message}`);
+      });
+    }
+  }
+
+  // Starts the device and connects a client. Endpoints and streams must be added before this.
+  async start(): Promise<Connection> {
+    await this.dev.start();
+    this.cli = NabtoClientFactory.create();
+    this.conn = this.createConnection();
+    await this.conn.connect();
+    return this.conn;
+  }
+
+  createConnection(): Connection {
+    let conn = this.cli!.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: this.cli!.createPrivateKey()});
+    return conn;
+  }
+
+  async stop() {
+    if (this.conn) {
+      try {
+        await this.conn.close();
+      } catch (err) { }
+      this.conn = undefined;
+    }
+    if (this.cli) {
+      this.cli.stop();
+      this.cli = undefined;
+    }
+    this.dev.stop();
+  }
+}
+
+export async function withLoopback<T>(fn: (lb: Loopback) => Promise<T>): Promise<T> {
+  let lb = new Loopback();
+  try {
+    return await fn(lb);
+  } finally {
+    await lb.stop();
+  }
+}
+
+export function nowMs(): number {
+  return Number(process.hrtime.bigint()) / 1e6;
+}
+
+// Nearest rank percentile of an ascending array.
+export function percentile(sorted: number[], p: number): number {
+  if (sorted.length == 0) {
+    return 0;
+  }
+  let rank = Math.ceil(p / 100 * sorted.length);
+  return sorted[Math.min(Math.max(rank, 1), sorted.length) - 1];
+}
+
+export function latencySummary(samples: number[]) {
+  let sorted = samples.slice().sort((a, b) => a - b);
+  return {
+    p50Ms: percentile(sorted, 50),
+    p99Ms: percentile(sorted, 99),
+    maxMs: sorted.length ? sorted[sorted.length - 1] : 0,
+  };
+}
@@ -0,0 +1,36 @@
+import { BenchResult } from './harness';
+
+// The stub SDK addon is only built with NABTO_DEVICE_BENCH=1, see binding.gyp.
+function loadAddon(): any {
+  try {
+    return require('bindings')('nabto_device_bench');
+  } catch (err) {
+    return undefined;
+  }
+}
+
+const addon = loadAddon();
+
+function nativeResult(name: string, count: number, nsPerOp: number): BenchResult {
+  return {
+    name: `native.${name}`,
+    params: {count},
+    unit: "ns/op",
+    value: nsPerOp,
+  };
+}
+
+// Per operation cost of the async bridge, measured without a device.
+export function nativeBenchmarks(scale: number): {name: string, run: () => Promise<BenchResult>}[] {
+  if (!addon) {
+    console.error("nabto_device_bench not built, skipping native benchmarks (NABTO_DEVICE_BENCH=1 node-gyp rebuild)");
+    return [];
+  }
+  let count = Math.round(100000 * scale);
+  return ["contextLifecycle", "arm", "dispatch", "tsfnCalls", "tsfnLifecycle"].map((name) => {
+    return {
+      name: `native.${name}`,
+      run: async () => nativeResult(name, count, await addon[name](count)),
+    };
+  });
+}
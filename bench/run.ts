@@ -0,0 +1,76 @@
+// Runs the benchmarks against a local device and client, and prints the results as JSON.
+//
+//   npm run bench [-- [--out results.json] [name filter ...]]
+//
+// BENCH_SCALE multiplies the amount of work done by every benchmark.
+import { execSync } from 'child_process';
+import { writeFileSync } from 'fs';
+import { env } from 'process';
+import { BenchResult } from './harness';
+import { coapRequests } from './coap.bench';
+import { streamAccept, streamRead, streamWrite } from './stream.bench';
+import { connectionEvents } from './events.bench';
+import { nativeBenchmarks } from './native.bench';
+
+const scale = Number(env.BENCH_SCALE ?? 1);
+const CHUNK_SIZES = [64, 1024, 16384];
+const STREAM_BYTES = Math.round(1024 * 1024 * scale);
+
+const benchmarks: {name: string, run: () => Promise<BenchResult>}[] = [
+  {name: "coap.requests", run: () => coapRequests(Math.round(2000 * scale), 1)},
+  {name: "coap.requests", run: () => coapRequests(Math.round(5000 * scale), 32)},
+  ...CHUNK_SIZES.flatMap((size) => [
+    {name: "stream.readSome", run: () => streamRead("readSome", size, STREAM_BYTES)},
+    {name: "stream.readAll", run: () => streamRead("readAll", size, STREAM_BYTES)},
+    {name: "stream.write", run: () => streamWrite(size, STREAM_BYTES)},
+  ]),
+  {name: "stream.accept", run: () => streamAccept(Math.round(200 * scale), 10)},
+  {name: "events.connection", run: () => connectionEvents(Math.round(50 * scale), 5)},
+  ...nativeBenchmarks(scale),
+];
+
+function commit(): string | undefined {
+  try {
+    return execSync("git rev-parse HEAD", {stdio: ["ignore", "pipe", "ignore"]}).toString().trim();
+  } catch (err) {
+    return undefined;
+  }
+}
+
+async function main() {
+  let args = process.argv.slice(2);
+  let out: string | undefined;
+  let outIndex = args.indexOf("--out");
+  if (outIndex >= 0) {
+    out = args[outIndex + 1];
+    args.splice(outIndex, 2);
+  }
+
+  let results: BenchResult[] = [];
+  for (let b of benchmarks) {
+    if (args.length > 0 && !args.some((f) => b.name.includes(f))) {
+      continue;
+    }
+    let result = await b.run();
+    console.error(`${result.name} ${JSON.stringify(result.params)}: ${result.value.toFixed(2)} ${result.unit}`);
+    results.push(result);
+  }
+
+  let report = JSON.stringify({
+    commit: commit(),
+    node: process.version,
+    date: new Date().toISOString(),
+    scale,
+    results,
+  }, null, 2);
+  if (out) {
+    writeFileSync(out, report + "\n");
+  } else {
+    console.log(report);
+  }
+}
+
+main().catch((err) => {
+  console.error(err);
+  process.exit(1);
+});
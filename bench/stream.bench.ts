@@ -0,0 +1,137 @@
+import { Stream } from '../src/NabtoDevice/NabtoDevice';
+import { BenchResult, nowMs, withLoopback } from './harness';
+
+const PORT = 4242;
+
+type DeviceRead = "readSome" | "readAll";
+
+// Client writes totalBytes in chunkSize writes, the device consumes them with readSome or readAll.
+export async function streamRead(mode: DeviceRead, chunkSize: number, totalBytes: number): Promise<BenchResult> {
+  return withLoopback(async (lb) => {
+    let received = new Promise<number>((resolve, reject) => {
+      lb.dev.addStream(PORT, async (stream: Stream) => {
+        try {
+          await stream.accept();
+          let got = 0;
+          while (got < totalBytes) {
+            let buf = mode == "readSome" ? await stream.readSome() : await stream.readAll(Math.min(chunkSize, totalBytes - got));
+            got += buf.byteLength;
+          }
+          resolve(nowMs());
+          await stream.close();
+        } catch (err) {
+          reject(err);
+        }
+      }, { readChunkSize: chunkSize });
+    });
+    let conn = await lb.start();
+    let stream = conn.createStream();
+    await stream.open(PORT);
+
+    let chunk = new ArrayBuffer(chunkSize);
+    let start = nowMs();
+    for (let sent = 0; sent < totalBytes; sent += chunkSize) {
+      await stream.write(sent + chunkSize <= totalBytes ? chunk : chunk.slice(0, totalBytes - sent));
+    }
+    let end = await received;
+
+    await stream.close().catch(() => {});
+    stream.abort();
+    return throughput(`stream.${mode}`, chunkSize, totalBytes, end - start);
+  });
+}
+
+// Device writes totalBytes in chunkSize writes, the client reads them.
+export async function streamWrite(chunkSize: number, totalBytes: number): Promise<BenchResult> {
+  return withLoopback(async (lb) => {
+    let written = new Promise<void>((resolve, reject) => {
+      lb.dev.addStream(PORT, async (stream: Stream) => {
+        try {
+          await stream.accept();
+          let chunk = new Uint8Array(chunkSize);
+          let writes: Promise<void>[] = [];
+          for (let sent = 0; sent < totalBytes; sent += chunkSize) {
+            // Keep the stream's write window full instead of waiting for each write.
+            if (writes.length >= stream.getWriteWindow()) {
+              await writes.shift();
+            }
+            writes.push(stream.write(sent + chunkSize <= totalBytes ? chunk : chunk.subarray(0, totalBytes - sent)));
+          }
+          await Promise.all(writes);
+          resolve();
+          await stream.close();
+        } catch (err) {
+          reject(err);
+        }
+      });
+    });
+    let conn = await lb.start();
+    let stream = conn.createStream();
+
+    let start = nowMs();
+    await stream.open(PORT);
+    let got = 0;
+    while (got < totalBytes) {
+      got += (await stream.readSome()).byteLength;
+    }
+    let elapsed = nowMs() - start;
+    await written;
+
+    await stream.close().catch(() => {});
+    stream.abort();
+    return throughput("stream.write", chunkSize, totalBytes, elapsed);
+  });
+}
+
+// Streams opened concurrently by the client and accepted by the device, in rounds of `concurrency`.
+export async function streamAccept(count: number, concurrency: number): Promise<BenchResult> {
+  return withLoopback(async (lb) => {
+    let accepted = 0;
+    let onAccepted: () => void = () => {};
+    lb.dev.addStream(PORT, async (stream: Stream) => {
+      try {
+        await stream.accept();
+        accepted++;
+        onAccepted();
+        // Wait for the client to close its end before closing ours.
+        await stream.readSome().catch(() => {});
+        await stream.close();
+      } catch (err) { }
+    });
+    let conn = await lb.start();
+
+    let start = nowMs();
+    for (let done = 0; done < count; done += concurrency) {
+      let round = Math.min(concurrency, count - done);
+      let target = accepted + round;
+      let allAccepted = new Promise<void>((resolve) => {
+        onAccepted = () => { if (accepted >= target) resolve(); };
+      });
+      let streams = Array.from({length: round}, () => conn.createStream());
+      await Promise.all(streams.map((s) => s.open(PORT)));
+      await allAccepted;
+      await Promise.all(streams.map(async (s) => {
+        await s.close().catch(() => {});
+        s.abort();
+      }));
+    }
+    let elapsed = nowMs() - start;
+
+    return {
+      name: "stream.accept",
+      params: {count, concurrency},
+      unit: "streams/s",
+      value: count / (elapsed / 1000),
+    };
+  });
+}
+
+function throughput(name: string, chunkSize: number, totalBytes: number, elapsedMs: number): BenchResult {
+  return {
+    name,
+    params: {chunkSize, totalBytes},
+    unit: "MiB/s",
+    value: totalBytes / (1024 * 1024) / (elapsedMs / 1000),
+    elapsedMs,
+  };
+}
@@ -1,6 +1,7 @@
 {
   "variables": {
-    "libPath": "<!(pwd)/build/Release"
+    "libPath": "<!(pwd)/build/Release",
+    "bench%": "<!(node -p \"process.env.NABTO_DEVICE_BENCH ? 1 : 0\")"
   },
   "targets": [
     {
@@ -35,5 +36,22 @@
       ],
        'defines': [ 'NAPI_DISABLE_CPP_EXCEPTIONS' ]
     }
+  ],
+  "conditions": [
+    [ "bench==1", {
+      "targets": [
+        {
+          "target_name": "nabto_device_bench",
+          "include_dirs": [
+            "<!(node -p \"require('node-addon-api').include_dir\")",
+            "./native_libraries/include"
+          ],
+          "sources": [ "native_code/bench/future_bench.cc",
+                      "native_code/bench/stub_device.cc",
+                    ],
+          'defines': [ 'NAPI_DISABLE_CPP_EXCEPTIONS' ]
+        }
+      ]
+    }]
   ]
 }
@@ -0,0 +1,456 @@
+#pragma once
+
+#include <napi.h>
+#include <nabto/nabto_device.h>
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum PolicyVerdict {
+    POLICY_ALLOW,
+    POLICY_DENY,
+    POLICY_NO_MATCH,
+};
+
+enum ConnectionVariable {
+    CONNECTION_VARIABLE_NONE,
+    CONNECTION_VARIABLE_FINGERPRINT,
+    CONNECTION_VARIABLE_IS_LOCAL,
+    CONNECTION_VARIABLE_IS_PASSWORD_AUTHENTICATED,
+    CONNECTION_VARIABLE_USERNAME,
+    CONNECTION_VARIABLE_COUNT,
+};
+
+inline ConnectionVariable connectionVariable(const std::string& name)
+{
+    if (name == "Connection:Fingerprint") {
+        return CONNECTION_VARIABLE_FINGERPRINT;
+    } else if (name == "Connection:IsLocal") {
+        return CONNECTION_VARIABLE_IS_LOCAL;
+    } else if (name == "Connection:IsPasswordAuthenticated") {
+        return CONNECTION_VARIABLE_IS_PASSWORD_AUTHENTICATED;
+    } else if (name == "Connection:Username") {
+        return CONNECTION_VARIABLE_USERNAME;
+    }
+    return CONNECTION_VARIABLE_NONE;
+}
+
+inline std::string toLower(std::string s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+// A request attribute, a connection variable or, as a condition value, a literal.
+struct PolicyOperand {
+    ConnectionVariable variable = CONNECTION_VARIABLE_NONE;
+    std::string name;
+};
+
+struct PolicyCondition {
+    bool negate;
+    PolicyOperand key;
+    // The condition holds if the key equals any of these, or none of them when negated.
+    std::vector<PolicyOperand> values;
+};
+
+struct PolicyStatement {
+    bool allow;
+    std::vector<PolicyCondition> conditions;
+};
+
+struct PolicyRole {
+    std::unordered_map<std::string, std::vector<const PolicyStatement*>> actions;
+    // Statements for actions ending in *, by the action without the *.
+    std::vector<std::pair<std::string, const PolicyStatement*>> prefixes;
+};
+
+// The values a policy is evaluated against, read from the request and the SDK
+// the first time they are needed.
+class PolicyRequest
+{
+public:
+    PolicyRequest(NabtoDevice* device, NabtoDeviceAuthorizationRequest* req)
+      : device_(device), req_(req), ref_(nabto_device_authorization_request_get_connection_ref(req))
+    {
+    }
+
+    const char* action()
+    {
+        return nabto_device_authorization_request_get_action(req_);
+    }
+
+    // nullptr if the attribute does not exist or the connection is gone.
+    const std::string* value(const PolicyOperand& operand)
+    {
+        if (operand.variable != CONNECTION_VARIABLE_NONE) {
+            return connection(operand.variable);
+        }
+        size_t size = nabto_device_authorization_request_get_attributes_size(req_);
+        for (size_t i = 0; i < size; i++) {
+            if (operand.name == nabto_device_authorization_request_get_attribute_name(req_, i)) {
+                attribute_ = nabto_device_authorization_request_get_attribute_value(req_, i);
+                return &attribute_;
+            }
+        }
+        return nullptr;
+    }
+
+    const std::string* connection(ConnectionVariable variable)
+    {
+        if (!loaded_[variable]) {
+            loaded_[variable] = true;
+            found_[variable] = load(variable, &values_[variable]);
+        }
+        return found_[variable] ? &values_[variable] : nullptr;
+    }
+
+private:
+    bool load(ConnectionVariable variable, std::string* value)
+    {
+        char* str;
+        switch (variable) {
+            case CONNECTION_VARIABLE_FINGERPRINT:
+                if (nabto_device_connection_get_client_fingerprint(device_, ref_, &str) != NABTO_DEVICE_EC_OK) {
+                    return false;
+                }
+                *value = toLower(str);
+                nabto_device_string_free(str);
+                return true;
+            case CONNECTION_VARIABLE_IS_LOCAL:
+                *value = nabto_device_connection_is_local(device_, ref_) ? "true" : "false";
+                return true;
+            case CONNECTION_VARIABLE_IS_PASSWORD_AUTHENTICATED:
+                *value = nabto_device_connection_is_password_authenticated(device_, ref_) ? "true" : "false";
+                return true;
+            case CONNECTION_VARIABLE_USERNAME:
+                if (nabto_device_connection_get_password_authentication_username(device_, ref_, &str) != NABTO_DEVICE_EC_OK) {
+                    return false;
+                }
+                *value = str;
+                nabto_device_string_free(str);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    NabtoDevice* device_;
+    NabtoDeviceAuthorizationRequest* req_;
+    NabtoDeviceConnectionRef ref_;
+    std::string attribute_;
+    bool loaded_[CONNECTION_VARIABLE_COUNT] = {};
+    bool found_[CONNECTION_VARIABLE_COUNT] = {};
+    std::string values_[CONNECTION_VARIABLE_COUNT];
+};
+
+// Authorization policy compiled from its JS form, so authorization requests can
+// be answered on the SDK thread which delivers them:
+//
+//   {
+//     policies: [{ id, statements: [{ effect: "Allow" | "Deny", actions: ["CoAP:Get", "TcpTunnel:*"],
+//                                     conditions?: [{ stringEquals | stringNotEquals: { key: value | [values] } }] }] }],
+//     roles: [{ id, policies: [policy ids] }],
+//     fingerprints?: { fingerprint: role id },
+//     defaultRole?: role id
+//   }
+//
+// The role of a request is the role of the client fingerprint, or the default
+// role. A key is a request attribute or one of Connection:Fingerprint,
+// Connection:IsLocal, Connection:IsPasswordAuthenticated and Connection:Username,
+// a value is a string or a variable like "${Connection:Username}". The request
+// is denied if a matching statement whose conditions all hold denies it, else
+// allowed if one allows it. Anything else is not matched by the policy.
+//
+// A compiled policy is immutable and shared with the SDK threads.
+class AuthPolicy
+{
+public:
+    // Returns nullptr with error set if the policy is malformed.
+    static AuthPolicy* compile(Napi::Object spec, std::string* error)
+    {
+        std::unique_ptr<AuthPolicy> policy(new AuthPolicy());
+        if (!policy->compilePolicies(spec.Get("policies"), error) ||
+            !policy->compileRoles(spec.Get("roles"), error) ||
+            !policy->compileFingerprints(spec.Get("fingerprints"), error))
+        {
+            return nullptr;
+        }
+        Napi::Value defaultRole = spec.Get("defaultRole");
+        if (!defaultRole.IsUndefined()) {
+            if (!defaultRole.IsString() || (policy->defaultRole_ = policy->findRole(defaultRole.ToString().Utf8Value())) == nullptr) {
+                *error = "defaultRole must be the id of a role";
+                return nullptr;
+            }
+        }
+        policy->policies_.clear();
+        return policy.release();
+    }
+
+    PolicyVerdict evaluate(NabtoDevice* device, NabtoDeviceAuthorizationRequest* req) const
+    {
+        PolicyRequest request(device, req);
+        const PolicyRole* role = defaultRole_;
+        const std::string* fingerprint = request.connection(CONNECTION_VARIABLE_FINGERPRINT);
+        if (fingerprint != nullptr) {
+            auto it = fingerprints_.find(*fingerprint);
+            if (it != fingerprints_.end()) {
+                role = it->second;
+            }
+        }
+        if (role == nullptr) {
+            return POLICY_NO_MATCH;
+        }
+
+        std::string action = request.action();
+        bool allowed = false;
+        auto check = [&](const PolicyStatement* s) {
+            if (!holds(s, &request)) {
+                return false;
+            }
+            allowed = allowed || s->allow;
+            return !s->allow;
+        };
+        auto it = role->actions.find(action);
+        if (it != role->actions.end()) {
+            for (auto s : it->second) {
+                if (check(s)) {
+                    return POLICY_DENY;
+                }
+            }
+        }
+        for (auto& p : role->prefixes) {
+            if (action.compare(0, p.first.size(), p.first) == 0 && check(p.second)) {
+                return POLICY_DENY;
+            }
+        }
+        return allowed ? POLICY_ALLOW : POLICY_NO_MATCH;
+    }
+
+private:
+    static bool holds(const PolicyStatement* statement, PolicyRequest* request)
+    {
+        for (auto& c : statement->conditions) {
+            const std::string* key = request->value(c.key);
+            if (key == nullptr) {
+                return false;
+            }
+            bool equal = false;
+            for (auto& v : c.values) {
+                const std::string* value = v.variable == CONNECTION_VARIABLE_NONE ? &v.name : request->connection(v.variable);
+                if (value != nullptr && *value == *key) {
+                    equal = true;
+                    break;
+                }
+            }
+            if (equal == c.negate) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const PolicyRole* findRole(const std::string& id) const
+    {
+        auto it = roles_.find(id);
+        return it == roles_.end() ? nullptr : &it->second;
+    }
+
+    static bool strings(Napi::Value value, std::vector<std::string>* out)
+    {
+        if (value.IsString()) {
+            out->push_back(value.ToString().Utf8Value());
+            return true;
+        }
+        if (!value.IsArray()) {
+            return false;
+        }
+        Napi::Array array = value.As<Napi::Array>();
+        for (uint32_t i = 0; i < array.Length(); i++) {
+            Napi::Value v = array.Get(i);
+            if (!v.IsString()) {
+                return false;
+            }
+            out->push_back(v.ToString().Utf8Value());
+        }
+        return true;
+    }
+
+    static bool compileKey(const std::string& name, PolicyOperand* operand)
+    {
+        operand->name = name;
+        if (name.compare(0, 11, "Connection:") == 0) {
+            operand->variable = connectionVariable(name);
+            return operand->variable != CONNECTION_VARIABLE_NONE;
+        }
+        return true;
+    }
+
+    static bool compileValue(const std::string& value, PolicyOperand* operand)
+    {
+        operand->name = value;
+        if (value.size() > 3 && value.compare(0, 2, "${") == 0 && value.back() == '}') {
+            operand->variable = connectionVariable(value.substr(2, value.size() - 3));
+            return operand->variable != CONNECTION_VARIABLE_NONE;
+        }
+        return true;
+    }
+
+    bool compileConditions(Napi::Value spec, PolicyStatement* statement, std::string* error)
+    {
+        if (spec.IsUndefined()) {
+            return true;
+        }
+        if (!spec.IsArray()) {
+            *error = "conditions must be an array";
+            return false;
+        }
+        Napi::Array conditions = spec.As<Napi::Array>();
+        for (uint32_t i = 0; i < conditions.Length(); i++) {
+            if (!conditions.Get(i).IsObject()) {
+                *error = "A condition must be an object";
+                return false;
+            }
+            Napi::Object condition = conditions.Get(i).ToObject();
+            Napi::Array ops = condition.GetPropertyNames();
+            for (uint32_t j = 0; j < ops.Length(); j++) {
+                std::string op = ops.Get(j).ToString().Utf8Value();
+                if (op != "stringEquals" && op != "stringNotEquals") {
+                    *error = "Unknown condition " + op;
+                    return false;
+                }
+                if (!condition.Get(op).IsObject()) {
+                    *error = op + " must be an object";
+                    return false;
+                }
+                Napi::Object keys = condition.Get(op).ToObject();
+                Napi::Array names = keys.GetPropertyNames();
+                for (uint32_t k = 0; k < names.Length(); k++) {
+                    std::string name = names.Get(k).ToString().Utf8Value();
+                    PolicyCondition c;
+                    c.negate = op == "stringNotEquals";
+                    std::vector<std::string> values;
+                    if (!compileKey(name, &c.key) || !strings(keys.Get(name), &values)) {
+                        *error = "Invalid condition on " + name;
+                        return false;
+                    }
+                    for (auto& v : values) {
+                        PolicyOperand operand;
+                        if (!compileValue(v, &operand)) {
+                            *error = "Unknown variable " + v;
+                            return false;
+                        }
+                        c.values.push_back(operand);
+                    }
+                    statement->conditions.push_back(c);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool compilePolicies(Napi::Value spec, std::string* error)
+    {
+        if (!spec.IsArray()) {
+            *error = "policies must be an array";
+            return false;
+        }
+        Napi::Array policies = spec.As<Napi::Array>();
+        for (uint32_t i = 0; i < policies.Length(); i++) {
+            Napi::Value p = policies.Get(i);
+            if (!p.IsObject() || !p.ToObject().Get("id").IsString() || !p.ToObject().Get("statements").IsArray()) {
+                *error = "A policy must have an id and statements";
+                return false;
+            }
+            std::string id = p.ToObject().Get("id").ToString().Utf8Value();
+            std::vector<std::pair<std::string, const PolicyStatement*>>& compiled = policies_[id];
+            Napi::Array statements = p.ToObject().Get("statements").As<Napi::Array>();
+            for (uint32_t j = 0; j < statements.Length(); j++) {
+                Napi::Value s = statements.Get(j);
+                std::string effect = s.IsObject() && s.ToObject().Get("effect").IsString() ? s.ToObject().Get("effect").ToString().Utf8Value() : "";
+                std::vector<std::string> actions;
+                if ((effect != "Allow" && effect != "Deny") || !strings(s.ToObject().Get("actions"), &actions)) {
+                    *error = "A statement in policy " + id + " must have an effect of Allow or Deny and actions";
+                    return false;
+                }
+                std::unique_ptr<PolicyStatement> statement(new PolicyStatement());
+                statement->allow = effect == "Allow";
+                if (!compileConditions(s.ToObject().Get("conditions"), statement.get(), error)) {
+                    return false;
+                }
+                for (auto& a : actions) {
+                    compiled.emplace_back(a, statement.get());
+                }
+                statements_.push_back(std::move(statement));
+            }
+        }
+        return true;
+    }
+
+    bool compileRoles(Napi::Value spec, std::string* error)
+    {
+        if (!spec.IsArray()) {
+            *error = "roles must be an array";
+            return false;
+        }
+        Napi::Array roles = spec.As<Napi::Array>();
+        for (uint32_t i = 0; i < roles.Length(); i++) {
+            Napi::Value r = roles.Get(i);
+            std::vector<std::string> policyIds;
+            if (!r.IsObject() || !r.ToObject().Get("id").IsString() || !strings(r.ToObject().Get("policies"), &policyIds)) {
+                *error = "A role must have an id and policies";
+                return false;
+            }
+            PolicyRole& role = roles_[r.ToObject().Get("id").ToString().Utf8Value()];
+            for (auto& id : policyIds) {
+                auto policy = policies_.find(id);
+                if (policy == policies_.end()) {
+                    *error = "Unknown policy " + id;
+                    return false;
+                }
+                for (auto& a : policy->second) {
+                    if (!a.first.empty() && a.first.back() == '*') {
+                        role.prefixes.emplace_back(a.first.substr(0, a.first.size() - 1), a.second);
+                    } else {
+                        role.actions[a.first].push_back(a.second);
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    bool compileFingerprints(Napi::Value spec, std::string* error)
+    {
+        if (spec.IsUndefined()) {
+            return true;
+        }
+        if (!spec.IsObject()) {
+            *error = "fingerprints must be an object";
+            return false;
+        }
+        Napi::Object fingerprints = spec.ToObject();
+        Napi::Array names = fingerprints.GetPropertyNames();
+        for (uint32_t i = 0; i < names.Length(); i++) {
+            std::string fingerprint = names.Get(i).ToString().Utf8Value();
+            Napi::Value roleId = fingerprints.Get(fingerprint);
+            const PolicyRole* role = roleId.IsString() ? findRole(roleId.ToString().Utf8Value()) : nullptr;
+            if (role == nullptr) {
+                *error = "The role of fingerprint " + fingerprint + " must be the id of a role";
+                return false;
+            }
+            fingerprints_[toLower(fingerprint)] = role;
+        }
+        return true;
+    }
+
+    std::vector<std::unique_ptr<PolicyStatement>> statements_;
+    // Only used while compiling, the (action, statement) pairs of each policy.
+    std::unordered_map<std::string, std::vector<std::pair<std::string, const PolicyStatement*>>> policies_;
+    std::unordered_map<std::string, PolicyRole> roles_;
+    std::unordered_map<std::string, const PolicyRole*> fingerprints_;
+    const PolicyRole* defaultRole_ = nullptr;
+};
@@ -1,12 +1,25 @@
 #pragma once
 
 #include <napi.h>
+#include <atomic>
+#include <memory>
 #include "future.h"
+#include "handles.h"
+#include "auth_policy.h"
+#include "verdict_cache.h"
+
+// Where the verdict of a request passed on to JS is cached once given.
+struct PendingVerdict {
+    std::shared_ptr<VerdictCache> cache;
+    std::string key;
+    uint64_t generation = 0;
+    bool passwordAuthenticated = false;
+};
 
 class AuthRequestFutureContext : public FutureContext
 {
 public:
-    AuthRequestFutureContext(NabtoDevice *device, Napi::Env env) : FutureContext(device, env)
+    AuthRequestFutureContext(FutureDispatcher* dispatcher, Napi::Env env) : FutureContext(dispatcher, env)
     {
         lis_ = nabto_device_listener_new(device_);
 
@@ -21,6 +34,12 @@ public:
     {
         nabto_device_listener_free(lis_);
     }
+
+    void cancel()
+    {
+        nabto_device_listener_stop(lis_);
+    }
+
     void rearm()
     {
         nabto_device_listener_new_authorization_request(lis_, future_, &req_);
@@ -32,9 +51,91 @@ public:
         return req_;
     }
 
+    // Called on the SDK thread. Requests answered from the cache or by the
+    // policy are released here and the listener waits for the next request, so
+    // the promise is only resolved with requests neither of them decides.
+    void resolved(NabtoDeviceError ec)
+    {
+        if (ec == NABTO_DEVICE_EC_OK && answer(req_)) {
+            nabto_device_listener_new_authorization_request(lis_, future_, &req_);
+            setFutureCallback();
+            return;
+        }
+        FutureContext::resolved(ec);
+    }
+
+    // Replaces the policy, nullptr removes it.
+    void setPolicy(AuthPolicy* policy)
+    {
+        std::atomic_store(&policy_, std::shared_ptr<const AuthPolicy>(policy));
+    }
+
+    // Replaces the cache, nullptr disables caching.
+    void setCache(std::shared_ptr<VerdictCache> cache)
+    {
+        std::atomic_store(&cache_, cache);
+    }
+
+    std::shared_ptr<VerdictCache> getCache()
+    {
+        return std::atomic_load(&cache_);
+    }
+
+    // Of the request last resolved with, for its AuthRequest.
+    PendingVerdict takePending()
+    {
+        PendingVerdict pending;
+        std::swap(pending, pending_);
+        return pending;
+    }
+
+    std::atomic<uint64_t> allowed_{0};
+    std::atomic<uint64_t> denied_{0};
+    // Requests the policy did not match, which are passed on to JS.
+    std::atomic<uint64_t> unmatched_{0};
+
 private:
+    bool answer(NabtoDeviceAuthorizationRequest *req)
+    {
+        std::shared_ptr<VerdictCache> cache = std::atomic_load(&cache_);
+        NabtoDeviceConnectionRef ref = nabto_device_authorization_request_get_connection_ref(req);
+        pending_ = PendingVerdict();
+        if (cache) {
+            pending_.generation = cache->generation();
+            pending_.key = VerdictCache::key(req);
+            pending_.passwordAuthenticated = nabto_device_connection_is_password_authenticated(device_, ref);
+            bool allowed;
+            if (cache->lookup(ref, pending_.passwordAuthenticated, pending_.key, &allowed)) {
+                nabto_device_authorization_request_verdict(req, allowed);
+                nabto_device_authorization_request_free(req);
+                return true;
+            }
+        }
+        std::shared_ptr<const AuthPolicy> policy = std::atomic_load(&policy_);
+        PolicyVerdict verdict = policy ? policy->evaluate(device_, req) : POLICY_NO_MATCH;
+        if (verdict == POLICY_NO_MATCH) {
+            if (policy) {
+                unmatched_++;
+            }
+            pending_.cache = cache;
+            return false;
+        }
+        (verdict == POLICY_ALLOW ? allowed_ : denied_)++;
+        if (cache) {
+            cache->insert(ref, pending_.passwordAuthenticated, pending_.key, verdict == POLICY_ALLOW, pending_.generation);
+        }
+        nabto_device_authorization_request_verdict(req, verdict == POLICY_ALLOW);
+        nabto_device_authorization_request_free(req);
+        return true;
+    }
+
     NabtoDeviceListener *lis_;
     NabtoDeviceAuthorizationRequest *req_;
+    // Read by SDK threads, so only accessed through std::atomic_load/store.
+    std::shared_ptr<const AuthPolicy> policy_;
+    std::shared_ptr<VerdictCache> cache_;
+    // Written on the SDK thread before the context is posted.
+    PendingVerdict pending_;
 };
 
 class AuthHandler : public Napi::ObjectWrap<AuthHandler>
@@ -50,6 +151,11 @@ public:
                     InstanceMethod("stop", &AuthHandler::Stop),
                     InstanceMethod("notifyRequest", &AuthHandler::NotifyRequest),
                     InstanceMethod("getCurrentRequest", &AuthHandler::GetCurrentRequest),
+                    InstanceMethod("setPolicy", &AuthHandler::SetPolicy),
+                    InstanceMethod("getPolicyStats", &AuthHandler::GetPolicyStats),
+                    InstanceMethod("setCache", &AuthHandler::SetCache),
+                    InstanceMethod("getCacheStats", &AuthHandler::GetCacheStats),
+                    InstanceMethod("clearCache", &AuthHandler::ClearCache),
                 });
 
         Napi::FunctionReference *constructor = new Napi::FunctionReference();
@@ -80,31 +186,175 @@ public:
         NodeNabtoDevice *d = Napi::ObjectWrap<NodeNabtoDevice>::Unwrap(device.ToObject());
 
         device_ = d->getDevice();
+        dispatcher_ = d->getDispatcher();
 
-        listener_ = new AuthRequestFutureContext(device_, env);
+        listener_ = new AuthRequestFutureContext(dispatcher_, env);
     }
 
     ~AuthHandler() {}
 
     void Stop(const Napi::CallbackInfo &info)
     {
-        listener_->stop();
+        stopEvictor();
+        if (listener_ != nullptr) {
+            listener_->stop();
+            listener_ = nullptr;
+        }
     }
 
     Napi::Value NotifyRequest(const Napi::CallbackInfo &info)
     {
+        if (listener_ == nullptr) {
+            Napi::Error::New(info.Env(), "Authorization request handler is stopped").ThrowAsJavaScriptException();
+            return Napi::Value();
+        }
         listener_->rearm();
         return listener_->Promise();
     }
 
     Napi::Value GetCurrentRequest(const Napi::CallbackInfo &info)
     {
-        return Napi::Number::New(info.Env(), (uint64_t)listener_->getRequest());
+        if (listener_ == nullptr) {
+            Napi::Error::New(info.Env(), "Authorization request handler is stopped").ThrowAsJavaScriptException();
+            return Napi::Value();
+        }
+        return handleValue(info.Env(), listener_->getRequest());
+    }
+
+    // Takes the policy object, see AuthPolicy, or undefined to remove the policy.
+    void SetPolicy(const Napi::CallbackInfo &info)
+    {
+        Napi::Env env = info.Env();
+        if (listener_ == nullptr) {
+            Napi::Error::New(env, "Authorization request handler is stopped").ThrowAsJavaScriptException();
+            return;
+        }
+        if (info.Length() < 1 || info[0].IsUndefined()) {
+            listener_->setPolicy(nullptr);
+            clearCache();
+            return;
+        }
+        if (!info[0].IsObject()) {
+            Napi::TypeError::New(env, "Policy object expected").ThrowAsJavaScriptException();
+            return;
+        }
+        std::string error;
+        AuthPolicy *policy = AuthPolicy::compile(info[0].ToObject(), &error);
+        if (policy == nullptr) {
+            Napi::TypeError::New(env, "Invalid policy: " + error).ThrowAsJavaScriptException();
+            return;
+        }
+        listener_->setPolicy(policy);
+        clearCache();
+    }
+
+    // Returns { allowed, denied, unmatched }.
+    Napi::Value GetPolicyStats(const Napi::CallbackInfo &info)
+    {
+        Napi::Env env = info.Env();
+        if (listener_ == nullptr) {
+            Napi::Error::New(env, "Authorization request handler is stopped").ThrowAsJavaScriptException();
+            return Napi::Value();
+        }
+        Napi::Object stats = Napi::Object::New(env);
+        stats.Set("allowed", Napi::Number::New(env, listener_->allowed_.load()));
+        stats.Set("denied", Napi::Number::New(env, listener_->denied_.load()));
+        stats.Set("unmatched", Napi::Number::New(env, listener_->unmatched_.load()));
+        return stats;
+    }
+
+    // Takes { ttl?, maxEntries? }, ttl in milliseconds, or undefined to disable the cache.
+    void SetCache(const Napi::CallbackInfo &info)
+    {
+        Napi::Env env = info.Env();
+        if (listener_ == nullptr) {
+            Napi::Error::New(env, "Authorization request handler is stopped").ThrowAsJavaScriptException();
+            return;
+        }
+        stopEvictor();
+        if (info.Length() < 1 || info[0].IsUndefined()) {
+            listener_->setCache(nullptr);
+            return;
+        }
+        if (!info[0].IsObject()) {
+            Napi::TypeError::New(env, "Cache options expected").ThrowAsJavaScriptException();
+            return;
+        }
+        Napi::Object opts = info[0].ToObject();
+        int64_t ttl = 10000;
+        size_t maxEntries = VerdictCache::DEFAULT_MAX_ENTRIES;
+        if (opts.Has("ttl") && opts.Get("ttl").IsNumber()) {
+            ttl = opts.Get("ttl").As<Napi::Number>().Int64Value();
+        }
+        if (opts.Has("maxEntries") && opts.Get("maxEntries").IsNumber()) {
+            maxEntries = opts.Get("maxEntries").As<Napi::Number>().Uint32Value();
+        }
+        if (ttl <= 0 || maxEntries == 0) {
+            Napi::TypeError::New(env, "ttl and maxEntries must be positive").ThrowAsJavaScriptException();
+            return;
+        }
+        auto cache = std::make_shared<VerdictCache>(std::chrono::milliseconds(ttl), maxEntries);
+        evictor_ = new VerdictCacheEvictor(dispatcher_, env, cache);
+        listener_->setCache(cache);
+    }
+
+    // Returns { hits, misses, entries }, or undefined if the cache is disabled.
+    Napi::Value GetCacheStats(const Napi::CallbackInfo &info)
+    {
+        std::shared_ptr<VerdictCache> cache = listener_ != nullptr ? listener_->getCache() : nullptr;
+        if (!cache) {
+            return info.Env().Undefined();
+        }
+        return cache->stats(info.Env());
+    }
+
+    // Drops the cached verdicts of a connection, or of all connections without a ref.
+    void ClearCache(const Napi::CallbackInfo &info)
+    {
+        std::shared_ptr<VerdictCache> cache = listener_ != nullptr ? listener_->getCache() : nullptr;
+        if (info.Length() < 1 || info[0].IsUndefined()) {
+            if (cache) {
+                cache->clear();
+            }
+            return;
+        }
+        NabtoDeviceConnectionRef ref;
+        if (!connectionRefFromValue(info[0], &ref)) {
+            Napi::TypeError::New(info.Env(), "Invalid ConnectionRef").ThrowAsJavaScriptException();
+            return;
+        }
+        if (cache) {
+            cache->invalidate(ref);
+        }
+    }
+
+    // The verdict cache of the current request, see AuthRequest.
+    PendingVerdict takePending()
+    {
+        return listener_ != nullptr ? listener_->takePending() : PendingVerdict();
     }
 
 private:
+    void clearCache()
+    {
+        std::shared_ptr<VerdictCache> cache = listener_->getCache();
+        if (cache) {
+            cache->clear();
+        }
+    }
+
+    void stopEvictor()
+    {
+        if (evictor_ != nullptr) {
+            evictor_->stop();
+            evictor_ = nullptr;
+        }
+    }
+
     NabtoDevice *device_;
+    FutureDispatcher *dispatcher_;
     AuthRequestFutureContext *listener_;
+    VerdictCacheEvictor *evictor_ = nullptr;
 };
 
 class AuthRequest : public Napi::ObjectWrap<AuthRequest>
@@ -121,6 +371,9 @@ public:
                     InstanceMethod("getAction", &AuthRequest::GetAction),
                     InstanceMethod("getConnectionRef", &AuthRequest::GetConnectionRef),
                     InstanceMethod("getAttributes", &AuthRequest::GetAttributes),
+                    InstanceMethod("getAttribute", &AuthRequest::GetAttribute),
+                    InstanceMethod("getAttributeCount", &AuthRequest::GetAttributeCount),
+                    InstanceMethod("getAttributeAt", &AuthRequest::GetAttributeAt),
                 });
 
         Napi::FunctionReference *constructor = new Napi::FunctionReference();
@@ -137,16 +390,34 @@ public:
         Napi::Env env = info.Env();
 
         int length = info.Length();
-        if (length < 1 || !info[0].IsNumber())
+        NabtoDeviceAuthorizationRequest* req;
+        if (length < 2 || !info[0].IsObject() || (req = takeHandle<NabtoDeviceAuthorizationRequest>(info[1])) == nullptr)
         {
-            Napi::TypeError::New(env, "Expected AuthorizationRequst reference").ThrowAsJavaScriptException();
+            Napi::TypeError::New(env, "Expected arguments: Device, unused AuthorizationRequest reference, AuthHandler?").ThrowAsJavaScriptException();
             return;
         }
-        req_ = (NabtoDeviceAuthorizationRequest *)info[0].ToNumber().Int64Value();
+        NodeNabtoDevice *d = Napi::ObjectWrap<NodeNabtoDevice>::Unwrap(info[0].ToObject());
+        // The request must be freed before the device.
+        dispatcher_ = d->getDispatcher();
+        dispatcher_->ref();
+        req_ = req;
+        dispatcher_->liveAuthRequests++;
+
+        if (length > 2 && info[2].IsObject()) {
+            pending_ = Napi::ObjectWrap<AuthHandler>::Unwrap(info[2].ToObject())->takePending();
+        }
     }
 
-    ~AuthRequest() {}
+    ~AuthRequest()
+    {
+        // Requests which never got a verdict are freed when collected.
+        release();
+        if (dispatcher_ != nullptr) {
+            dispatcher_->unref();
+        }
+    }
 
+    // The request is freed once the verdict is given.
     void Verdict(const Napi::CallbackInfo &info)
     {
         int length = info.Length();
@@ -155,26 +426,43 @@ public:
             Napi::TypeError::New(info.Env(), "Boolean expected").ThrowAsJavaScriptException();
             return;
         }
+        if (!checkRequest(info.Env())) {
+            return;
+        }
 
-        nabto_device_authorization_request_verdict(req_, info[0].ToBoolean().Value());
+        bool allowed = info[0].ToBoolean().Value();
+        if (pending_.cache) {
+            NabtoDeviceConnectionRef ref = nabto_device_authorization_request_get_connection_ref(req_);
+            pending_.cache->insert(ref, pending_.passwordAuthenticated, pending_.key, allowed, pending_.generation);
+        }
+        nabto_device_authorization_request_verdict(req_, allowed);
+        release();
     }
 
     Napi::Value GetAction(const Napi::CallbackInfo &info)
     {
-
+        if (!checkRequest(info.Env())) {
+            return Napi::Value();
+        }
         const char *action = nabto_device_authorization_request_get_action(req_);
         return Napi::String::New(info.Env(), action);
     }
 
     Napi::Value GetConnectionRef(const Napi::CallbackInfo &info)
     {
+        if (!checkRequest(info.Env())) {
+            return Napi::Value();
+        }
         NabtoDeviceConnectionRef ref = nabto_device_authorization_request_get_connection_ref(req_);
 
-        return Napi::Number::New(info.Env(), (uint64_t)ref);
+        return connectionRefValue(info.Env(), ref);
     }
 
     Napi::Value GetAttributes(const Napi::CallbackInfo &info)
     {
+        if (!checkRequest(info.Env())) {
+            return Napi::Value();
+        }
         size_t size = nabto_device_authorization_request_get_attributes_size(req_);
         Napi::Object retVal = Napi::Object::New(info.Env());
         for (size_t i = 0; i < size; i++) {
@@ -185,6 +473,77 @@ public:
         return retVal;
     }
 
+    // The value of one attribute, or undefined. Only the value is converted to a JS string.
+    Napi::Value GetAttribute(const Napi::CallbackInfo &info)
+    {
+        Napi::Env env = info.Env();
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Attribute name expected").ThrowAsJavaScriptException();
+            return Napi::Value();
+        }
+        if (!checkRequest(env)) {
+            return Napi::Value();
+        }
+        std::string name = info[0].ToString().Utf8Value();
+        size_t size = nabto_device_authorization_request_get_attributes_size(req_);
+        for (size_t i = 0; i < size; i++) {
+            if (name == nabto_device_authorization_request_get_attribute_name(req_, i)) {
+                return Napi::String::New(env, nabto_device_authorization_request_get_attribute_value(req_, i));
+            }
+        }
+        return env.Undefined();
+    }
+
+    Napi::Value GetAttributeCount(const Napi::CallbackInfo &info)
+    {
+        if (!checkRequest(info.Env())) {
+            return Napi::Value();
+        }
+        return Napi::Number::New(info.Env(), nabto_device_authorization_request_get_attributes_size(req_));
+    }
+
+    // Returns [name, value] of the attribute at index.
+    Napi::Value GetAttributeAt(const Napi::CallbackInfo &info)
+    {
+        Napi::Env env = info.Env();
+        if (info.Length() < 1 || !info[0].IsNumber()) {
+            Napi::TypeError::New(env, "Attribute index expected").ThrowAsJavaScriptException();
+            return Napi::Value();
+        }
+        if (!checkRequest(env)) {
+            return Napi::Value();
+        }
+        uint32_t i = info[0].As<Napi::Number>().Uint32Value();
+        if (i >= nabto_device_authorization_request_get_attributes_size(req_)) {
+            Napi::RangeError::New(env, "Attribute index out of range").ThrowAsJavaScriptException();
+            return Napi::Value();
+        }
+        Napi::Array attribute = Napi::Array::New(env, 2);
+        attribute.Set((uint32_t)0, nabto_device_authorization_request_get_attribute_name(req_, i));
+        attribute.Set((uint32_t)1, nabto_device_authorization_request_get_attribute_value(req_, i));
+        return attribute;
+    }
+
 private:
-    NabtoDeviceAuthorizationRequest *req_;
+    void release()
+    {
+        if (req_ != NULL) {
+            nabto_device_authorization_request_free(req_);
+            req_ = NULL;
+            dispatcher_->liveAuthRequests--;
+        }
+    }
+
+    bool checkRequest(Napi::Env env)
+    {
+        if (req_ == NULL) {
+            Napi::Error::New(env, "The authorization request is released once the verdict is given").ThrowAsJavaScriptException();
+            return false;
+        }
+        return true;
+    }
+
+    FutureDispatcher *dispatcher_ = nullptr;
+    NabtoDeviceAuthorizationRequest *req_ = NULL;
+    PendingVerdict pending_;
 };
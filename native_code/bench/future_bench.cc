@@ -0,0 +1,238 @@
+#include <napi.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../future.h"
+#include "stub_device.h"
+
+// Micro benchmarks of the async bridge between the SDK and JS, run against the
+// stub SDK in stub_device.cc. Every function returns (or resolves with) the
+// number of nanoseconds per operation.
+
+static double nowNs()
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static FutureDispatcher* newDispatcher(Napi::Env env)
+{
+    return new FutureDispatcher(stub_device_new(), env);
+}
+
+static uint32_t countArg(const Napi::CallbackInfo& info)
+{
+    if (info.Length() < 1 || !info[0].IsNumber() || info[0].As<Napi::Number>().Uint32Value() == 0) {
+        Napi::TypeError::New(info.Env(), "Positive iteration count expected").ThrowAsJavaScriptException();
+        return 0;
+    }
+    return info[0].As<Napi::Number>().Uint32Value();
+}
+
+// Construction and deletion of a context, including the future pool and the promise.
+Napi::Value ContextLifecycle(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    uint32_t count = countArg(info);
+    if (count == 0) {
+        return env.Undefined();
+    }
+    FutureDispatcher* dispatcher = newDispatcher(env);
+    double start = nowNs();
+    for (uint32_t i = 0; i < count; i++) {
+        Napi::HandleScope scope(env);
+        delete new FutureContext(dispatcher, env);
+    }
+    double elapsed = nowNs() - start;
+    dispatcher->unref();
+    return Napi::Number::New(env, elapsed / count);
+}
+
+// arm() on an existing context: a new promise and registering the future callback.
+Napi::Value Arm(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    uint32_t count = countArg(info);
+    if (count == 0) {
+        return env.Undefined();
+    }
+    FutureDispatcher* dispatcher = newDispatcher(env);
+    FutureContext* context = new FutureContext(dispatcher, env);
+    double start = nowNs();
+    for (uint32_t i = 0; i < count; i++) {
+        Napi::HandleScope scope(env);
+        context->arm(false);
+    }
+    double elapsed = nowNs() - start;
+    delete context;
+    dispatcher->unref();
+    return Napi::Number::New(env, elapsed / count);
+}
+
+class DispatchRun;
+
+class DispatchContext : public FutureContext
+{
+public:
+    DispatchContext(FutureDispatcher* dispatcher, Napi::Env env, DispatchRun* run) : FutureContext(dispatcher, env), run_(run)
+    {
+        arm(false);
+    }
+
+    void complete(Napi::Env env);
+
+private:
+    DispatchRun* run_;
+};
+
+// Resolves every context from a separate thread, as the SDK does, and measures
+// until the last complete() has run on the JS thread.
+class DispatchRun
+{
+public:
+    DispatchRun(Napi::Env env, uint32_t count) : deferred_(Napi::Promise::Deferred::New(env)), count_(count)
+    {
+        dispatcher_ = newDispatcher(env);
+        for (uint32_t i = 0; i < count; i++) {
+            futures_.push_back(new DispatchContext(dispatcher_, env, this));
+        }
+        start_ = nowNs();
+        // The contexts own the futures, so only the future pointers are handed to the thread.
+        std::vector<NabtoDeviceFuture*> futures;
+        for (auto c : futures_) {
+            futures.push_back(c->future_);
+        }
+        thread_ = std::thread([futures]() {
+            for (auto f : futures) {
+                stub_future_resolve(f, NABTO_DEVICE_EC_OK);
+            }
+        });
+    }
+
+    void completed(Napi::Env env)
+    {
+        if (++completed_ < count_) {
+            return;
+        }
+        double elapsed = nowNs() - start_;
+        thread_.join();
+        deferred_.Resolve(Napi::Number::New(env, elapsed / count_));
+        // The last context is deleted after this returns, which releases the dispatcher.
+        dispatcher_->unref();
+        delete this;
+    }
+
+    Napi::Value Promise()
+    {
+        return deferred_.Promise();
+    }
+
+private:
+    Napi::Promise::Deferred deferred_;
+    FutureDispatcher* dispatcher_;
+    std::vector<DispatchContext*> futures_;
+    std::thread thread_;
+    uint32_t count_;
+    uint32_t completed_ = 0;
+    double start_;
+};
+
+void DispatchContext::complete(Napi::Env env)
+{
+    FutureContext::complete(env);
+    run_->completed(env);
+}
+
+// futureCallback -> post -> uv_async -> complete(), per resolved future.
+Napi::Value Dispatch(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    uint32_t count = countArg(info);
+    if (count == 0) {
+        return env.Undefined();
+    }
+    return (new DispatchRun(env, count))->Promise();
+}
+
+struct TsfnRun {
+    Napi::Promise::Deferred deferred;
+    uint32_t count;
+    uint32_t remaining;
+    double start;
+    std::thread thread;
+};
+
+static void TsfnCallJs(Napi::Env env, Napi::Function callback, TsfnRun* run, uint32_t* data)
+{
+    if (env != nullptr && callback != nullptr) {
+        callback.Call({});
+    }
+}
+
+typedef Napi::TypedThreadSafeFunction<TsfnRun, uint32_t, TsfnCallJs> BenchTsfn;
+
+static void resolveTsfnRun(Napi::Env env, TsfnRun* run)
+{
+    double elapsed = nowNs() - run->start;
+    run->deferred.Resolve(Napi::Number::New(env, elapsed / run->count));
+    delete run;
+}
+
+// NonBlockingCall from another thread, as the log callback does, until every
+// call has reached JS and the function is finalized.
+Napi::Value TsfnCalls(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    uint32_t count = countArg(info);
+    if (count == 0) {
+        return env.Undefined();
+    }
+    auto run = new TsfnRun{Napi::Promise::Deferred::New(env), count, count, 0};
+    Napi::Function noop = Napi::Function::New(env, [](const Napi::CallbackInfo&) {});
+    Napi::Value promise = run->deferred.Promise();
+    BenchTsfn tsfn = BenchTsfn::New(env, noop, "TsfnCalls", 0, 1, run, [](Napi::Env env, void*, TsfnRun* run) {
+        run->thread.join();
+        resolveTsfnRun(env, run);
+    });
+    run->start = nowNs();
+    run->thread = std::thread([tsfn, count]() mutable {
+        for (uint32_t i = 0; i < count; i++) {
+            tsfn.NonBlockingCall();
+        }
+        tsfn.Release();
+    });
+    return promise;
+}
+
+// Creating and releasing a thread safe function, until all of them are finalized.
+Napi::Value TsfnLifecycle(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+    uint32_t count = countArg(info);
+    if (count == 0) {
+        return env.Undefined();
+    }
+    auto run = new TsfnRun{Napi::Promise::Deferred::New(env), count, count, 0};
+    Napi::Function noop = Napi::Function::New(env, [](const Napi::CallbackInfo&) {});
+    Napi::Value promise = run->deferred.Promise();
+    run->start = nowNs();
+    for (uint32_t i = 0; i < count; i++) {
+        BenchTsfn tsfn = BenchTsfn::New(env, noop, "TsfnLifecycle", 0, 1, run, [](Napi::Env env, void*, TsfnRun* run) {
+            if (--run->remaining == 0) {
+                resolveTsfnRun(env, run);
+            }
+        });
+        tsfn.Release();
+    }
+    return promise;
+}
+
+Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
+    exports.Set("contextLifecycle", Napi::Function::New(env, ContextLifecycle));
+    exports.Set("arm", Napi::Function::New(env, Arm));
+    exports.Set("dispatch", Napi::Function::New(env, Dispatch));
+    exports.Set("tsfnCalls", Napi::Function::New(env, TsfnCalls));
+    exports.Set("tsfnLifecycle", Napi::Function::New(env, TsfnLifecycle));
+    return exports;
+}
+
+NODE_API_MODULE(bench, InitAll)
@@ -0,0 +1,61 @@
+#include "stub_device.h"
+
+struct NabtoDevice_ {
+};
+
+struct NabtoDeviceFuture_ {
+    NabtoDeviceFutureCallback callback = nullptr;
+    void* data = nullptr;
+};
+
+const NabtoDeviceError NABTO_DEVICE_EC_OK = 0;
+const NabtoDeviceError NABTO_DEVICE_EC_STOPPED = 1;
+
+NabtoDevice* stub_device_new()
+{
+    return new NabtoDevice_;
+}
+
+void stub_future_resolve(NabtoDeviceFuture* future, NabtoDeviceError ec)
+{
+    NabtoDeviceFutureCallback callback = future->callback;
+    future->callback = nullptr;
+    if (callback != nullptr) {
+        callback(future, ec, future->data);
+    }
+}
+
+void NABTO_DEVICE_API nabto_device_stop(NabtoDevice* device)
+{
+}
+
+void NABTO_DEVICE_API nabto_device_free(NabtoDevice* device)
+{
+    delete device;
+}
+
+NabtoDeviceFuture* NABTO_DEVICE_API nabto_device_future_new(NabtoDevice* device)
+{
+    return new NabtoDeviceFuture_;
+}
+
+void NABTO_DEVICE_API nabto_device_future_free(NabtoDeviceFuture* future)
+{
+    delete future;
+}
+
+void NABTO_DEVICE_API nabto_device_future_set_callback(NabtoDeviceFuture* future, NabtoDeviceFutureCallback callback, void* data)
+{
+    future->callback = callback;
+    future->data = data;
+}
+
+const char* NABTO_DEVICE_API nabto_device_error_get_message(NabtoDeviceError error)
+{
+    return error == NABTO_DEVICE_EC_OK ? "Ok" : "Stopped";
+}
+
+const char* NABTO_DEVICE_API nabto_device_error_get_string(NabtoDeviceError error)
+{
+    return error == NABTO_DEVICE_EC_OK ? "NABTO_DEVICE_EC_OK" : "NABTO_DEVICE_EC_STOPPED";
+}
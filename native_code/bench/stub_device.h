@@ -0,0 +1,12 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+// Stand-in for the parts of the SDK used by FutureContext and FutureDispatcher,
+// so the async bridge can be measured without a running device. Futures only
+// resolve when stub_future_resolve() is called.
+
+NabtoDevice* stub_device_new();
+
+// Calls the callback registered on the future, from the calling thread.
+void stub_future_resolve(NabtoDeviceFuture* future, NabtoDeviceError ec);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <napi.h>
+
+// Gets the bytes of an ArrayBuffer or of an ArrayBuffer view (Buffer,
+// TypedArray, DataView) at its offset, without copying.
+inline bool getByteRange(Napi::Value value, uint8_t** data, size_t* length)
+{
+    if (value.IsArrayBuffer()) {
+        Napi::ArrayBuffer ab = value.As<Napi::ArrayBuffer>();
+        *data = static_cast<uint8_t*>(ab.Data());
+        *length = ab.ByteLength();
+    } else if (value.IsTypedArray()) {
+        Napi::TypedArray ta = value.As<Napi::TypedArray>();
+        *data = static_cast<uint8_t*>(ta.ArrayBuffer().Data()) + ta.ByteOffset();
+        *length = ta.ByteLength();
+    } else if (value.IsDataView()) {
+        Napi::DataView dv = value.As<Napi::DataView>();
+        *data = static_cast<uint8_t*>(dv.Data());
+        *length = dv.ByteLength();
+    } else {
+        return false;
+    }
+    return true;
+}
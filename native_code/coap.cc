@@ -1,85 +1,353 @@
 #include "coap.h"
 #include "node_nabto_device.h"
 #include "future.h"
+#include "byte_range.h"
+#include "constants.h"
+#include "handles.h"
 
 
-Napi::Object CoapEndpoint::Init(Napi::Env env, Napi::Object exports)
+static std::vector<std::string> splitPath(const std::string& path)
+{
+    std::vector<std::string> segments;
+    size_t begin = 0;
+    for (size_t i = 0; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+            if (i > begin) {
+                segments.push_back(path.substr(begin, i - begin));
+            }
+            begin = i + 1;
+        }
+    }
+    return segments;
+}
+
+static bool isParameter(const std::string& segment)
+{
+    return segment.size() > 2 && segment.front() == '{' && segment.back() == '}';
+}
+
+// First segments of the endpoints the SDK registers itself.
+static bool isSdkPrefix(const std::string& segment)
+{
+    return segment == "tcp-tunnels" || segment == "p2p";
+}
+
+CoapRouteListener::CoapRouteListener(FutureDispatcher* dispatcher, Napi::Env env, CoapRouter* router, NabtoDeviceCoapMethod method, const std::vector<std::string>& literals)
+: FutureContext(dispatcher, env), router_(router), method_(method), literals_(literals)
+{
+    repeatable_ = true;
+    lis_ = nabto_device_listener_new(device_);
+
+    std::vector<std::string> path;
+    std::vector<const char*> segments;
+    for (size_t i = 0; i < literals.size(); i++) {
+        if (literals[i].empty()) {
+            params_.push_back("p" + std::to_string(i));
+            path.push_back("{" + params_.back() + "}");
+        } else {
+            params_.push_back("");
+            path.push_back(literals[i]);
+        }
+    }
+    for (auto& seg : path) {
+        segments.push_back(seg.c_str());
+    }
+    segments.push_back(NULL);
+
+    initError_ = nabto_device_coap_init_listener(device_, lis_, method, segments.data());
+    if (initError_ == NABTO_DEVICE_EC_OK) {
+        listen();
+    }
+}
+
+void CoapRouteListener::complete(Napi::Env env)
+{
+    setActive(false);
+    if (ec_ != NABTO_DEVICE_EC_OK) {
+        // The listener is stopped, it is deleted once the router stops it.
+        return;
+    }
+    std::vector<CoapArrival> batch = {{req_, arrivedUs_}};
+    if (isStopped()) {
+        // The router may be gone.
+        nabto_device_coap_error_response(req_, 503, "Service Unavailable");
+        nabto_device_coap_request_free(req_);
+        return;
+    }
+
+    // Queued requests resolve the future right away.
+    NabtoDeviceError ec = NABTO_DEVICE_EC_OK;
+    while (batch.size() < MAX_REQUEST_BATCH) {
+        nabto_device_listener_new_coap_request(lis_, future_, &req_);
+        ec = nabto_device_future_ready(future_);
+        if (ec != NABTO_DEVICE_EC_OK) {
+            break;
+        }
+        batch.push_back({req_, LatencyHistogram::nowUs()});
+    }
+    if (ec == NABTO_DEVICE_EC_FUTURE_NOT_RESOLVED) {
+        setActive(true);
+        setFutureCallback();
+    } else if (ec == NABTO_DEVICE_EC_OK) {
+        // The batch is full, continue with the rest in the next one.
+        listen();
+    }
+    // Otherwise the listener was stopped and is not re-armed.
+
+    router_->dispatch(env, method_, literals_, params_, batch);
+}
+
+Napi::Object CoapRouter::Init(Napi::Env env, Napi::Object exports)
 {
     Napi::Function func =
         DefineClass(
             env,
-            "CoapEndpoint",
+            "CoapRouter",
             {
-                InstanceMethod("stop", &CoapEndpoint::Stop),
-                InstanceMethod("notifyRequest", &CoapEndpoint::NotifyRequest),
-                InstanceMethod("getCurrentRequest", &CoapEndpoint::GetCurrentRequest),
+                InstanceMethod("addRoute", &CoapRouter::AddRoute),
+                InstanceMethod("stop", &CoapRouter::Stop),
+                InstanceMethod("getStats", &CoapRouter::GetStats),
             });
 
     Napi::FunctionReference *constructor = new Napi::FunctionReference();
     *constructor = Napi::Persistent(func);
     env.SetInstanceData(constructor);
 
-    exports.Set("CoapEndpoint", func);
+    exports.Set("CoapRouter", func);
     return exports;
 }
 
-CoapEndpoint::CoapEndpoint(const Napi::CallbackInfo &info)
-: Napi::ObjectWrap<CoapEndpoint>(info) {
+CoapRouter::CoapRouter(const Napi::CallbackInfo &info)
+: Napi::ObjectWrap<CoapRouter>(info) {
     Napi::Env env = info.Env();
 
     int length = info.Length();
-    if (length < 3)
+    if (length < 2)
     {
-        Napi::TypeError::New(env, "Expected 3 arguments: Device, method, path").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected 2 arguments: Device, callback").ThrowAsJavaScriptException();
         return;
     }
     Napi::Value device = info[0];
-    Napi::Value method = info[1];
-    Napi::Value path = info[2];
+    Napi::Value callback = info[1];
 
     if(!device.IsObject()) {
          Napi::TypeError::New(env, "First arg expected Nabto Device object").ThrowAsJavaScriptException();
         return;
     }
 
-    if(!method.IsString()) {
-         Napi::TypeError::New(env, "Second arg expected method string").ThrowAsJavaScriptException();
-        return;
-    }
-
-    if(!path.IsString()) {
-         Napi::TypeError::New(env, "Third arg expected path string").ThrowAsJavaScriptException();
+    if(!callback.IsFunction()) {
+         Napi::TypeError::New(env, "Second arg expected callback Function").ThrowAsJavaScriptException();
         return;
     }
 
     NodeNabtoDevice *d = Napi::ObjectWrap<NodeNabtoDevice>::Unwrap(device.ToObject());
 
     device_ = d->getDevice();
+    dispatcher_ = d->getDispatcher();
+    callback_ = Napi::Persistent(callback.As<Napi::Function>());
+}
 
-    listener_ = new CoapRequestFutureContext(device_, env, method.ToString().Utf8Value(), path.ToString().Utf8Value());
+CoapRouter::~CoapRouter()
+{
+    stopListeners();
 }
 
-CoapEndpoint::~CoapEndpoint()
+Napi::Value CoapRouter::AddRoute(const Napi::CallbackInfo &info)
 {
+    Napi::Env env = info.Env();
+
+    int length = info.Length();
+    if (length < 2 || !info[0].IsNumber() || !info[1].IsString())
+    {
+        Napi::TypeError::New(env, "Expected arguments method: Number, path: String").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+    NabtoDeviceCoapMethod method;
+    if (!coapMethodFromValue(info[0], &method)) {
+        Napi::TypeError::New(env, "Invalid CoAP method").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+    if (stopped_) {
+        Napi::Error::New(env, "CoAP router is stopped").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+
+    std::vector<std::string> segments = splitPath(info[1].ToString().Utf8Value());
+
+    // The SDK matches literal segments before parameters without backtracking,
+    // so a catch all listener never sees paths below the endpoints the SDK
+    // registers itself. Routes there get a listener on their literal segments.
+    std::vector<std::string> literals(segments.size());
+    if (!segments.empty() && isSdkPrefix(segments[0])) {
+        for (size_t i = 0; i < segments.size(); i++) {
+            if (!isParameter(segments[i])) {
+                literals[i] = segments[i];
+            }
+        }
+    }
+    auto key = std::make_pair(method, literals);
+    CoapRouteListener* listener = nullptr;
+    if (listeners_.find(key) == listeners_.end()) {
+        listener = new CoapRouteListener(dispatcher_, env, this, method, literals);
+        NabtoDeviceError ec = listener->initError();
+        if (ec != NABTO_DEVICE_EC_OK) {
+            listener->stop();
+            Napi::Error err = Napi::Error::New(env, std::string("Could not listen for CoAP requests: ") + nabto_device_error_get_message(ec));
+            err.Set("code", nabto_device_error_get_string(ec));
+            err.ThrowAsJavaScriptException();
+            return Napi::Value();
+        }
+    }
+
+    Route route;
+    route.method = method;
+    route.path = info[1].ToString().Utf8Value();
+    route.stats = std::make_shared<CoapRouteStats>();
+    Node* node = &root_;
+    for (size_t i = 0; i < segments.size(); i++) {
+        std::unique_ptr<Node>& next = isParameter(segments[i]) ? node->param : node->children[segments[i]];
+        if (!next) {
+            next.reset(new Node());
+        }
+        if (isParameter(segments[i])) {
+            route.params.push_back(std::make_pair(i, segments[i].substr(1, segments[i].size() - 2)));
+        }
+        node = next.get();
+    }
+    if (node->handlers[method] >= 0) {
+        if (listener != nullptr) {
+            listener->stop();
+        }
+        Napi::Error::New(env, "A CoAP endpoint is already registered for this method and path").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+
+    int id = routes_.size();
+    routes_.push_back(route);
+    node->handlers[method] = id;
+    if (listener != nullptr) {
+        listeners_[key] = listener;
+    }
+    return Napi::Number::New(env, id);
 }
 
-void CoapEndpoint::Stop(const Napi::CallbackInfo &info)
+void CoapRouter::Stop(const Napi::CallbackInfo &info)
 {
-    listener_->stop();
+    stopListeners();
 }
 
-Napi::Value CoapEndpoint::NotifyRequest(const Napi::CallbackInfo &info)
+void CoapRouter::stopListeners()
 {
-    listener_->rearm();
-    return listener_->Promise();
+    for (auto& l : listeners_) {
+        l.second->stop();
+    }
+    listeners_.clear();
+    stopped_ = true;
 }
 
-Napi::Value CoapEndpoint::GetCurrentRequest(const Napi::CallbackInfo &info)
+const CoapRouter::Node* CoapRouter::match(const Node* node, const std::vector<std::string>& segments, size_t i, NabtoDeviceCoapMethod method)
 {
-    return Napi::Number::New(info.Env(), (uint64_t)listener_->getRequest());
+    if (i == segments.size()) {
+        return node->handlers[method] >= 0 ? node : nullptr;
+    }
+    auto it = node->children.find(segments[i]);
+    if (it != node->children.end()) {
+        const Node* found = match(it->second.get(), segments, i + 1, method);
+        if (found != nullptr) {
+            return found;
+        }
+    }
+    if (node->param) {
+        return match(node->param.get(), segments, i + 1, method);
+    }
+    return nullptr;
+}
 
+void CoapRouter::dispatch(Napi::Env env, NabtoDeviceCoapMethod method, const std::vector<std::string>& literals, const std::vector<std::string>& params, const std::vector<CoapArrival>& requests)
+{
+    Napi::Array batch = Napi::Array::New(env);
+    uint32_t n = 0;
+    std::vector<std::string> segments;
+    uint64_t dispatchedUs = LatencyHistogram::nowUs();
+    for (auto& arrival : requests) {
+        NabtoDeviceCoapRequest* req = arrival.req;
+        segments.clear();
+        for (size_t i = 0; i < params.size(); i++) {
+            if (params[i].empty()) {
+                segments.push_back(literals[i]);
+                continue;
+            }
+            const char* seg = nabto_device_coap_request_get_parameter(req, params[i].c_str());
+            segments.push_back(seg != NULL ? seg : "");
+        }
+        const Node* node = match(&root_, segments, 0, method);
+        if (node == nullptr) {
+            nabto_device_coap_error_response(req, 404, "Not Found");
+            nabto_device_coap_request_free(req);
+            continue;
+        }
+        int id = node->handlers[method];
+        Napi::Value routeParams = env.Undefined();
+        if (!routes_[id].params.empty()) {
+            Napi::Object obj = Napi::Object::New(env);
+            for (auto& p : routes_[id].params) {
+                obj.Set(p.second, segments[p.first]);
+            }
+            routeParams = obj;
+        }
+        batch.Set(n++, Napi::Number::New(env, id));
+        batch.Set(n++, handleValue(env, req));
+        batch.Set(n++, routeParams);
+
+        CoapRequestTiming timing;
+        timing.stats = routes_[id].stats;
+        timing.arrivedUs = arrival.arrivedUs;
+        timing.dispatchedUs = dispatchedUs;
+        timing.stats->queueWait.record(dispatchedUs - arrival.arrivedUs);
+        dispatching_[req] = timing;
+    }
+    if (n > 0) {
+        callback_.Call({batch});
+    }
+    dispatching_.clear();
 }
 
+bool CoapRouter::takeTiming(NabtoDeviceCoapRequest* req, CoapRequestTiming* timing)
+{
+    auto it = dispatching_.find(req);
+    if (it == dispatching_.end()) {
+        return false;
+    }
+    *timing = it->second;
+    dispatching_.erase(it);
+    return true;
+}
+
+// Returns [{ method, path, queueWait, handler, total }] with a histogram summary
+// per endpoint, optionally resetting the histograms.
+Napi::Value CoapRouter::GetStats(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    bool reset = info.Length() > 0 && info[0].IsBoolean() && info[0].ToBoolean().Value();
+
+    Napi::Array result = Napi::Array::New(env, routes_.size());
+    for (size_t i = 0; i < routes_.size(); i++) {
+        Route& r = routes_[i];
+        Napi::Object o = Napi::Object::New(env);
+        o.Set("method", Napi::Number::New(env, r.method));
+        o.Set("path", r.path);
+        o.Set("queueWait", r.stats->queueWait.toObject(env));
+        o.Set("handler", r.stats->handler.toObject(env));
+        o.Set("total", r.stats->total.toObject(env));
+        result.Set(i, o);
+        if (reset) {
+            r.stats->queueWait.reset();
+            r.stats->handler.reset();
+            r.stats->total.reset();
+        }
+    }
+    return result;
+}
 
 
 
@@ -100,6 +368,8 @@ Napi::Object CoapRequest::Init(Napi::Env env, Napi::Object exports)
                 InstanceMethod("setResponseCode", &CoapRequest::SetResponseCode),
                 InstanceMethod("setResponsePayload", &CoapRequest::SetResponsePayload),
                 InstanceMethod("responseReady", &CoapRequest::ResponseReady),
+                InstanceMethod("respond", &CoapRequest::Respond),
+                InstanceMethod("isResponded", &CoapRequest::IsResponded),
             });
 
     Napi::FunctionReference *constructor = new Napi::FunctionReference();
@@ -115,20 +385,70 @@ CoapRequest::CoapRequest(const Napi::CallbackInfo &info)
     Napi::Env env = info.Env();
 
     int length = info.Length();
-    if (length < 1 || !info[0].IsNumber())
+    NabtoDeviceCoapRequest* req;
+    if (length < 2 || !info[0].IsObject() || (req = takeHandle<NabtoDeviceCoapRequest>(info[1])) == nullptr)
     {
-        Napi::TypeError::New(env, "Expected coapRequst reference").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected arguments: Device, unused coapRequest reference, router?").ThrowAsJavaScriptException();
         return;
     }
-    req_ = (NabtoDeviceCoapRequest*)info[0].ToNumber().Int64Value();
+    NodeNabtoDevice *d = Napi::ObjectWrap<NodeNabtoDevice>::Unwrap(info[0].ToObject());
+    // The request must be freed before the device.
+    dispatcher_ = d->getDispatcher();
+    dispatcher_->ref();
+    req_ = req;
+    dispatcher_->liveCoapRequests++;
+
+    if (length > 2 && info[2].IsObject()) {
+        CoapRouter* router = Napi::ObjectWrap<CoapRouter>::Unwrap(info[2].ToObject());
+        router->takeTiming(req_, &timing_);
+    }
 }
 
 CoapRequest::~CoapRequest()
 {
+    // Requests which were never responded to are freed when collected.
+    release();
+    if (dispatcher_ != nullptr) {
+        dispatcher_->unref();
+    }
+}
+
+// Called once the response is sent. The payload is freed with the request, so
+// the view is detached first. If sending fails the request and its payload stay usable.
+void CoapRequest::responded()
+{
+    detachPayload();
+    if (timing_.stats) {
+        uint64_t now = LatencyHistogram::nowUs();
+        timing_.stats->handler.record(now - timing_.dispatchedUs);
+        timing_.stats->total.record(now - timing_.arrivedUs);
+    }
+    release();
+}
+
+void CoapRequest::release()
+{
+    if (req_ != NULL) {
+        nabto_device_coap_request_free(req_);
+        req_ = NULL;
+        dispatcher_->liveCoapRequests--;
+    }
+}
+
+bool CoapRequest::checkRequest(Napi::Env env)
+{
+    if (req_ == NULL) {
+        Napi::Error::New(env, "The CoAP request is released once the response is sent").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
 }
 
 Napi::Value CoapRequest::GetFormat(const Napi::CallbackInfo &info)
 {
+    if (!checkRequest(info.Env())) {
+        return Napi::Value();
+    }
     uint16_t format;
     NabtoDeviceError ec = nabto_device_coap_request_get_content_format(req_, &format);
     if (ec != NABTO_DEVICE_EC_OK) {
@@ -138,8 +458,21 @@ Napi::Value CoapRequest::GetFormat(const Napi::CallbackInfo &info)
     return Napi::Number::New(info.Env(), format);
 }
 
+// The payload is returned as a view of the memory owned by the request, without
+// copying it. The view keeps the request object alive, and it is detached when
+// the response is sent, so it can never outlive the payload.
 Napi::Value CoapRequest::GetPayload(const Napi::CallbackInfo &info)
 {
+    if (!checkRequest(info.Env())) {
+        return Napi::Value();
+    }
+    if (!payload_.IsEmpty()) {
+        Napi::ArrayBuffer buf = payload_.Value();
+        // Empty if the view is collected and its finalizer has not run yet.
+        if (!buf.IsEmpty()) {
+            return buf;
+        }
+    }
     void* payload;
     size_t length;
     NabtoDeviceError ec = nabto_device_coap_request_get_payload(req_, &payload, &length);
@@ -147,15 +480,41 @@ Napi::Value CoapRequest::GetPayload(const Napi::CallbackInfo &info)
         Napi::TypeError::New(info.Env(), nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
         return Napi::Value();
     }
-    Napi::ArrayBuffer buf = Napi::ArrayBuffer::New(info.Env(), payload, length);
+    if (length == 0) {
+        return Napi::ArrayBuffer::New(info.Env(), 0);
+    }
+    Napi::ArrayBuffer buf = Napi::ArrayBuffer::New(info.Env(), payload, length, [](Napi::Env, void*, CoapRequest* req) {
+        // A newer view may have replaced the collected one.
+        if (--req->payloadViews_ == 0) {
+            req->payload_.Reset();
+        }
+        req->Unref();
+    }, this);
+    Ref();
+    payloadViews_++;
+    payload_ = Napi::Weak(buf);
     return buf;
 }
 
+void CoapRequest::detachPayload()
+{
+    if (payload_.IsEmpty()) {
+        return;
+    }
+    Napi::ArrayBuffer buf = payload_.Value();
+    if (!buf.IsEmpty() && !buf.IsDetached()) {
+        buf.Detach();
+    }
+}
+
 Napi::Value CoapRequest::GetConnectionRef(const Napi::CallbackInfo &info)
 {
+    if (!checkRequest(info.Env())) {
+        return Napi::Value();
+    }
     NabtoDeviceConnectionRef ref = nabto_device_coap_request_get_connection_ref(req_);
 
-    return Napi::Number::New(info.Env(), (uint64_t)ref);
+    return connectionRefValue(info.Env(), ref);
 }
 
 Napi::Value CoapRequest::GetParameter(const Napi::CallbackInfo &info)
@@ -168,7 +527,13 @@ Napi::Value CoapRequest::GetParameter(const Napi::CallbackInfo &info)
         Napi::TypeError::New(env, "Expected String argument").ThrowAsJavaScriptException();
         return Napi::Value();
     }
+    if (!checkRequest(env)) {
+        return Napi::Value();
+    }
     const char* param = nabto_device_coap_request_get_parameter(req_, info[0].ToString().Utf8Value().c_str());
+    if (param == NULL) {
+        return env.Undefined();
+    }
     return Napi::String::New(env, param);
 }
 
@@ -182,12 +547,16 @@ void CoapRequest::SendErrorResponse(const Napi::CallbackInfo &info)
         Napi::TypeError::New(env, "Expected arguments code: Number, message: String").ThrowAsJavaScriptException();
         return;
     }
+    if (!checkRequest(env)) {
+        return;
+    }
 
     NabtoDeviceError ec = nabto_device_coap_error_response(req_, info[0].ToNumber().Uint32Value(), info[1].ToString().Utf8Value().c_str());
     if (ec != NABTO_DEVICE_EC_OK) {
         Napi::TypeError::New(info.Env(), nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
         return;
     }
+    responded();
 }
 
 void CoapRequest::SetResponseCode(const Napi::CallbackInfo &info)
@@ -200,6 +569,9 @@ void CoapRequest::SetResponseCode(const Napi::CallbackInfo &info)
         Napi::TypeError::New(env, "Expected argument code: Number").ThrowAsJavaScriptException();
         return;
     }
+    if (!checkRequest(env)) {
+        return;
+    }
 
     NabtoDeviceError ec = nabto_device_coap_response_set_code(req_, info[0].ToNumber().Uint32Value());
     if (ec != NABTO_DEVICE_EC_OK) {
@@ -212,33 +584,84 @@ void CoapRequest::SetResponsePayload(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
+    uint8_t* data;
+    size_t dataLength;
     int length = info.Length();
-    if (length < 2 || !info[0].IsNumber() || !info[1].IsArrayBuffer())
+    if (length < 2 || !info[0].IsNumber() || !getByteRange(info[1], &data, &dataLength))
     {
-        Napi::TypeError::New(env, "Expected arguments format: Number, message: ArrayBuffer").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected arguments format: Number, message: ArrayBuffer or ArrayBuffer view").ThrowAsJavaScriptException();
+        return;
+    }
+    if (!checkRequest(env)) {
         return;
     }
 
-    Napi::Number contentFormat = info[0].ToNumber();
-    Napi::ArrayBuffer buf = info[1].As<Napi::ArrayBuffer>();
-
-    NabtoDeviceError ec = nabto_device_coap_response_set_payload(req_, buf.Data(), buf.ByteLength());
+    NabtoDeviceError ec = setPayload(info[0].ToNumber().Uint32Value(), data, dataLength);
     if (ec != NABTO_DEVICE_EC_OK) {
         Napi::TypeError::New(info.Env(), nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
         return;
     }
-    ec = nabto_device_coap_response_set_content_format(req_, contentFormat.Uint32Value());
+}
+
+NabtoDeviceError CoapRequest::setPayload(uint16_t contentFormat, uint8_t* data, size_t length)
+{
+    // The SDK copies the payload, so the view is only read during the call.
+    NabtoDeviceError ec = nabto_device_coap_response_set_payload(req_, data, length);
+    if (ec != NABTO_DEVICE_EC_OK) {
+        return ec;
+    }
+    return nabto_device_coap_response_set_content_format(req_, contentFormat);
+}
+
+void CoapRequest::Respond(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    uint8_t* data = NULL;
+    size_t dataLength = 0;
+    int length = info.Length();
+    bool hasFormat = length > 1 && !info[1].IsUndefined();
+    bool hasPayload = length > 2 && !info[2].IsUndefined();
+    if (length < 1 || !info[0].IsNumber() || (hasFormat && !info[1].IsNumber()) ||
+        (hasPayload && (!hasFormat || !getByteRange(info[2], &data, &dataLength))))
+    {
+        Napi::TypeError::New(env, "Expected arguments format: code: Number, contentFormat?: Number, payload?: ArrayBuffer or ArrayBuffer view").ThrowAsJavaScriptException();
+        return;
+    }
+    if (!checkRequest(env)) {
+        return;
+    }
+
+    NabtoDeviceError ec = nabto_device_coap_response_set_code(req_, info[0].ToNumber().Uint32Value());
+    if (ec == NABTO_DEVICE_EC_OK && hasPayload) {
+        ec = setPayload(info[1].ToNumber().Uint32Value(), data, dataLength);
+    } else if (ec == NABTO_DEVICE_EC_OK && hasFormat) {
+        ec = nabto_device_coap_response_set_content_format(req_, info[1].ToNumber().Uint32Value());
+    }
+    if (ec == NABTO_DEVICE_EC_OK) {
+        ec = nabto_device_coap_response_ready(req_);
+    }
     if (ec != NABTO_DEVICE_EC_OK) {
         Napi::TypeError::New(info.Env(), nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
         return;
     }
+    responded();
 }
 
 void CoapRequest::ResponseReady(const Napi::CallbackInfo &info)
 {
+    if (!checkRequest(info.Env())) {
+        return;
+    }
     NabtoDeviceError ec = nabto_device_coap_response_ready(req_);
     if (ec != NABTO_DEVICE_EC_OK) {
         Napi::TypeError::New(info.Env(), nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
         return;
     }
+    responded();
+}
+
+Napi::Value CoapRequest::IsResponded(const Napi::CallbackInfo &info)
+{
+    return Napi::Boolean::New(info.Env(), req_ == NULL);
 }
@@ -1,120 +1,146 @@
 #pragma once
 
 #include <napi.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 #include "future.h"
+#include "latency_histogram.h"
 
-class CoapRequestFutureContext : public FutureContext
+class CoapRouter;
+
+// Latency of the requests handled by one endpoint. Queue wait is from the
+// request leaving the SDK listener until it is dispatched to JS, handler time
+// from the dispatch until the response is sent.
+struct CoapRouteStats {
+    LatencyHistogram queueWait;
+    LatencyHistogram handler;
+    LatencyHistogram total;
+};
+
+struct CoapRequestTiming {
+    std::shared_ptr<CoapRouteStats> stats;
+    uint64_t arrivedUs = 0;
+    uint64_t dispatchedUs = 0;
+};
+
+struct CoapArrival {
+    NabtoDeviceCoapRequest* req;
+    uint64_t arrivedUs;
+};
+
+// Listens for every request of one method with a path of a given depth, by
+// registering a path consisting only of parameters ({p0}/{p1}/...). When a
+// request arrives, the requests already queued in the listener are taken as
+// well and the whole batch is handed to the router. The listener is re-armed
+// natively, so there is no promise chain per listener.
+class CoapRouteListener : public FutureContext
 {
 public:
-    CoapRequestFutureContext(NabtoDevice *device, Napi::Env env, std::string method, std::string path) : FutureContext(device, env)
-    {
-        lis_ = nabto_device_listener_new(device_);
-
-        auto m = methodFromString(method);
-        createPath(path);
-
-        const char** segments = (const char**)calloc(path_.size()+1, sizeof(const char*));
-        size_t i = 0;
-        for (i = 0; i < path_.size(); i++) {
-            segments[i] = path_[i].c_str();
-        }
-        segments[i] = NULL;
-
-        NabtoDeviceError ec = nabto_device_coap_init_listener(device_, lis_, m, segments);
-        if (ec != NABTO_DEVICE_EC_OK) {
-            // TODO: error handling
-        }
-        free(segments);
-    }
+    // literals has a literal segment or, for a parameter, an empty string per path segment.
+    CoapRouteListener(FutureDispatcher* dispatcher, Napi::Env env, CoapRouter* router, NabtoDeviceCoapMethod method, const std::vector<std::string>& literals);
 
-    ~CoapRequestFutureContext() {
+    ~CoapRouteListener() {
         nabto_device_listener_free(lis_);
     }
-    void rearm()
+
+    void cancel()
     {
-        nabto_device_listener_new_coap_request(lis_, future_, &req_);
-        arm(true);
+        nabto_device_listener_stop(lis_);
     }
 
-    NabtoDeviceCoapRequest* getRequest()
+    void resolved(NabtoDeviceError ec)
     {
-        return req_;
+        arrivedUs_ = LatencyHistogram::nowUs();
+        FutureContext::resolved(ec);
     }
 
-private:
-    NabtoDeviceCoapMethod methodFromString(std::string method)
+    void complete(Napi::Env env);
+
+    // The error from registering the path with the SDK. The listener does not
+    // listen if it failed, and must be stopped.
+    NabtoDeviceError initError()
     {
-        if (method == "NABTO_DEVICE_COAP_GET")
-        {
-            return NABTO_DEVICE_COAP_GET;
-        }
-        else if (method == "NABTO_DEVICE_COAP_POST")
-        {
-            return NABTO_DEVICE_COAP_POST;
-        }
-        else if (method == "NABTO_DEVICE_COAP_PUT")
-        {
-            return NABTO_DEVICE_COAP_PUT;
-        }
-        else if (method == "NABTO_DEVICE_COAP_DELETE")
-        {
-            return NABTO_DEVICE_COAP_DELETE;
-        }
-        else
-        {
-            return NABTO_DEVICE_COAP_GET;
-        }
+        return initError_;
     }
 
-    void createPath(std::string path)
+private:
+    static const size_t MAX_REQUEST_BATCH = 256;
+
+    void listen()
     {
-        size_t begin = 0;
-        path_.clear();
-        pathCStr_.clear();
-        size_t i = 0;
-        for (i = 0; i < path.size(); i++) {
-            if (path[i] == '/') {
-                if (i == begin) {
-                    begin++;
-                    continue;
-                }
-                std::string seg = path.substr(begin, i-begin);
-                path_.push_back(seg);
-                pathCStr_.push_back(seg.c_str());
-                begin = i + 1;
-            }
-        }
-        if (begin < i) { // we did not end on a /
-            std::string seg = path.substr(begin, i-begin);
-            path_.push_back(seg);
-            pathCStr_.push_back(seg.c_str());
-        }
-        pathCStr_.push_back(NULL);
+        nabto_device_listener_new_coap_request(lis_, future_, &req_);
+        setActive(true);
+        setFutureCallback();
     }
 
-//    char** path_;
-    std::vector<std::string> path_;
-    std::vector<const char*> pathCStr_;
-
+    CoapRouter* router_;
+    NabtoDeviceCoapMethod method_;
+    std::vector<std::string> literals_;
+    // Names of the parameters the path segments are registered as, empty for literal segments.
+    std::vector<std::string> params_;
+    NabtoDeviceError initError_;
     NabtoDeviceListener *lis_;
     NabtoDeviceCoapRequest* req_;
+    uint64_t arrivedUs_ = 0;
 };
 
-
-class CoapEndpoint : public Napi::ObjectWrap<CoapEndpoint>
+// Routes CoAP requests for all registered endpoints of a device. Paths are kept
+// in a trie of segments where literal segments take precedence over parameter
+// segments. Only one SDK listener per method and path depth is used, however
+// many endpoints are registered, and matched requests are delivered in batches
+// through the same JS callback as callback([handlerId, request, parameters,
+// handlerId, request, parameters, ...]). Requests which match no endpoint are
+// answered with 4.04 natively. Endpoints below the top level paths of the SDK's
+// own endpoints are registered with the SDK on their literal segments instead.
+class CoapRouter : public Napi::ObjectWrap<CoapRouter>
 {
 public:
     static Napi::Object Init(Napi::Env env, Napi::Object exports);
-    CoapEndpoint(const Napi::CallbackInfo &info);
-    ~CoapEndpoint();
+    CoapRouter(const Napi::CallbackInfo &info);
+    ~CoapRouter();
+
+    Napi::Value AddRoute(const Napi::CallbackInfo &info);
     void Stop(const Napi::CallbackInfo &info);
+    Napi::Value GetStats(const Napi::CallbackInfo &info);
+
+    // Called by the listeners on the JS thread. Takes ownership of the requests.
+    // Path segment i of the requests is literals[i], or the parameter params[i] if that is not empty.
+    void dispatch(Napi::Env env, NabtoDeviceCoapMethod method, const std::vector<std::string>& literals, const std::vector<std::string>& params, const std::vector<CoapArrival>& requests);
 
-    Napi::Value NotifyRequest(const Napi::CallbackInfo &info);
-    Napi::Value GetCurrentRequest(const Napi::CallbackInfo &info);
+    // Hands the timing of a request being dispatched to its CoapRequest wrapper.
+    bool takeTiming(NabtoDeviceCoapRequest* req, CoapRequestTiming* timing);
 
 private:
+    struct Node {
+        std::map<std::string, std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> param;
+        // Handler id indexed by NabtoDeviceCoapMethod, -1 if none.
+        int handlers[4] = {-1, -1, -1, -1};
+    };
+
+    struct Route {
+        NabtoDeviceCoapMethod method;
+        std::string path;
+        // Parameter names by segment index.
+        std::vector<std::pair<size_t, std::string>> params;
+        std::shared_ptr<CoapRouteStats> stats;
+    };
+
+    static const Node* match(const Node* node, const std::vector<std::string>& segments, size_t i, NabtoDeviceCoapMethod method);
+    void stopListeners();
+
     NabtoDevice* device_;
-    CoapRequestFutureContext* listener_;
+    FutureDispatcher* dispatcher_;
+    Napi::FunctionReference callback_;
+    Node root_;
+    std::vector<Route> routes_;
+    // By method and the literal segments of the SDK path, see CoapRouteListener.
+    std::map<std::pair<NabtoDeviceCoapMethod, std::vector<std::string>>, CoapRouteListener*> listeners_;
+    // Timing of the requests in the batch being dispatched.
+    std::map<NabtoDeviceCoapRequest*, CoapRequestTiming> dispatching_;
+    bool stopped_ = false;
 };
 
 class CoapRequest : public Napi::ObjectWrap<CoapRequest>
@@ -133,8 +159,24 @@ public:
     void SetResponseCode(const Napi::CallbackInfo &info);
     void SetResponsePayload(const Napi::CallbackInfo &info);
     void ResponseReady(const Napi::CallbackInfo &info);
+    void Respond(const Napi::CallbackInfo &info);
+    // Whether the response is sent and the request released.
+    Napi::Value IsResponded(const Napi::CallbackInfo &info);
 
 
 private:
-    NabtoDeviceCoapRequest* req_;
+    // Records the latency of the request and frees it once the response is sent.
+    void responded();
+    void release();
+    bool checkRequest(Napi::Env env);
+    void detachPayload();
+    NabtoDeviceError setPayload(uint16_t contentFormat, uint8_t* data, size_t length);
+
+    FutureDispatcher* dispatcher_ = nullptr;
+    NabtoDeviceCoapRequest* req_ = NULL;
+    CoapRequestTiming timing_;
+    // Weak reference to the payload view handed out by getPayload().
+    Napi::Reference<Napi::ArrayBuffer> payload_;
+    // Payload views not finalized yet.
+    size_t payloadViews_ = 0;
 };
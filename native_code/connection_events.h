@@ -1,14 +1,17 @@
 #pragma once
 
 #include <napi.h>
+#include <string>
+#include <unordered_map>
 
 #include "future.h"
+#include "constants.h"
 
 
 class ConnectionEventFutureContext: public FutureContext
 {
   public:
-  ConnectionEventFutureContext(NabtoDevice* device, Napi::Env env) : FutureContext(device, env)
+  ConnectionEventFutureContext(FutureDispatcher* dispatcher, Napi::Env env) : FutureContext(dispatcher, env)
   {
     lis_ = nabto_device_listener_new(device_);
     NabtoDeviceError ec = nabto_device_connection_events_init_listener(device_, lis_);
@@ -24,22 +27,17 @@ class ConnectionEventFutureContext: public FutureContext
     nabto_device_listener_free(lis_);
   }
 
+  void cancel() {
+    nabto_device_listener_stop(lis_);
+  }
+
   void rearm() {
     nabto_device_listener_connection_event(lis_, future_, &ref_, &event_);
     arm(true);
   }
 
-// TODO: replace this with new embedded sdk api function for this.
-  std::string getEventString() {
-    if (event_ == NABTO_DEVICE_CONNECTION_EVENT_OPENED) {
-        return "NABTO_DEVICE_CONNECTION_EVENT_OPENED";
-    } else if (event_ == NABTO_DEVICE_CONNECTION_EVENT_CLOSED) {
-        return "NABTO_DEVICE_CONNECTION_EVENT_CLOSED";
-    } else if (event_ == NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED) {
-        return "NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED";
-    } else {
-        return "";
-    }
+  ConnectionEventCode getEventCode() {
+    return connectionEventCode(event_);
   }
 
   uint64_t getConnectionRef() {
@@ -51,3 +49,132 @@ class ConnectionEventFutureContext: public FutureContext
   NabtoDeviceConnectionRef ref_;
 };
 
+
+struct ConnectionInfo {
+  std::string fingerprint;
+  bool local = false;
+  bool passwordAuthenticated = false;
+  std::string username;
+};
+
+// Metadata of the open connections, so the per request lookups done by
+// authorization and CoAP handlers do not each go to the SDK. Entries are added
+// on OPENED, or on the first lookup of a connection opened before the cache
+// listened, refreshed on CHANNEL_CHANGED and removed on CLOSED. A connection can
+// become password authenticated after it is opened, so that is looked up again
+// until it is true. The fingerprint never changes.
+//
+// The cache has its own connection events listener, which does not keep the
+// event loop alive, and is only used on the JS thread.
+class ConnectionInfoCache: public FutureContext
+{
+  public:
+  ConnectionInfoCache(FutureDispatcher* dispatcher, Napi::Env env) : FutureContext(dispatcher, env)
+  {
+    background_ = true;
+    repeatable_ = true;
+    lis_ = nabto_device_listener_new(device_);
+    if (nabto_device_connection_events_init_listener(device_, lis_) == NABTO_DEVICE_EC_OK) {
+      listening_ = true;
+      listen();
+    }
+  }
+
+  ~ConnectionInfoCache() {
+    nabto_device_listener_free(lis_);
+  }
+
+  void cancel() {
+    nabto_device_listener_stop(lis_);
+  }
+
+  void complete(Napi::Env env) {
+    setActive(false);
+    if (ec_ != NABTO_DEVICE_EC_OK || isStopped()) {
+      // Lookups still work without the listener, entries are just not evicted.
+      listening_ = false;
+      return;
+    }
+    ConnectionEventCode code = connectionEventCode(event_);
+    if (code == CONNECTION_EVENT_CLOSED) {
+      connections_.erase(ref_);
+    } else if (code == CONNECTION_EVENT_OPENED) {
+      ConnectionInfo info;
+      if (query(device_, ref_, &info) == NABTO_DEVICE_EC_OK) {
+        connections_[ref_] = info;
+      }
+    } else if (code == CONNECTION_EVENT_CHANNEL_CHANGED) {
+      auto it = connections_.find(ref_);
+      if (it != connections_.end()) {
+        it->second.local = nabto_device_connection_is_local(device_, ref_);
+      }
+    }
+    listen();
+  }
+
+  // Returns the info of an open connection, or the error from the SDK.
+  NabtoDeviceError lookup(NabtoDeviceConnectionRef ref, const ConnectionInfo** info) {
+    auto it = connections_.find(ref);
+    if (it == connections_.end()) {
+      ConnectionInfo fresh;
+      NabtoDeviceError ec = query(device_, ref, &fresh);
+      if (ec != NABTO_DEVICE_EC_OK) {
+        return ec;
+      }
+      if (!listening_) {
+        // Nothing would evict the entry.
+        uncached_ = fresh;
+        *info = &uncached_;
+        return NABTO_DEVICE_EC_OK;
+      }
+      it = connections_.emplace(ref, fresh).first;
+    } else if (!it->second.passwordAuthenticated) {
+      refreshPassword(device_, ref, &it->second);
+    }
+    *info = &it->second;
+    return NABTO_DEVICE_EC_OK;
+  }
+
+  size_t size() {
+    return connections_.size();
+  }
+
+  // Reads the info of a connection directly from the SDK.
+  static NabtoDeviceError query(NabtoDevice* device, NabtoDeviceConnectionRef ref, ConnectionInfo* info) {
+    char* fp;
+    NabtoDeviceError ec = nabto_device_connection_get_client_fingerprint(device, ref, &fp);
+    if (ec != NABTO_DEVICE_EC_OK) {
+      return ec;
+    }
+    info->fingerprint = fp;
+    nabto_device_string_free(fp);
+    info->local = nabto_device_connection_is_local(device, ref);
+    refreshPassword(device, ref, info);
+    return NABTO_DEVICE_EC_OK;
+  }
+
+  private:
+  void listen() {
+    nabto_device_listener_connection_event(lis_, future_, &ref_, &event_);
+    setActive(true);
+    setFutureCallback();
+  }
+
+  static void refreshPassword(NabtoDevice* device, NabtoDeviceConnectionRef ref, ConnectionInfo* info) {
+    info->passwordAuthenticated = nabto_device_connection_is_password_authenticated(device, ref);
+    if (info->passwordAuthenticated) {
+      char* name;
+      if (nabto_device_connection_get_password_authentication_username(device, ref, &name) == NABTO_DEVICE_EC_OK) {
+        info->username = name;
+        nabto_device_string_free(name);
+      }
+    }
+  }
+
+  NabtoDeviceListener* lis_;
+  NabtoDeviceConnectionEvent event_;
+  NabtoDeviceConnectionRef ref_;
+  bool listening_ = false;
+  std::unordered_map<NabtoDeviceConnectionRef, ConnectionInfo> connections_;
+  ConnectionInfo uncached_;
+};
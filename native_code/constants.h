@@ -0,0 +1,89 @@
+#pragma once
+
+#include <napi.h>
+#include <nabto/nabto_device.h>
+
+// Event and method codes passed to JS as plain numbers. The SDK only exports its
+// event values as extern constants, so the binding uses its own fixed codes,
+// which the enums in NabtoDevice.ts are declared with. The codes are exported
+// as `constants` so the TS layer can check that the two agree when it loads.
+
+enum ConnectionEventCode {
+    CONNECTION_EVENT_UNKNOWN = -1,
+    CONNECTION_EVENT_OPENED = 0,
+    CONNECTION_EVENT_CLOSED = 1,
+    CONNECTION_EVENT_CHANNEL_CHANGED = 2,
+};
+
+enum DeviceEventCode {
+    DEVICE_EVENT_UNKNOWN = -1,
+    DEVICE_EVENT_ATTACHED = 0,
+    DEVICE_EVENT_DETACHED = 1,
+    DEVICE_EVENT_CLOSED = 2,
+    DEVICE_EVENT_UNKNOWN_FINGERPRINT = 3,
+    DEVICE_EVENT_WRONG_PRODUCT_ID = 4,
+    DEVICE_EVENT_WRONG_DEVICE_ID = 5,
+};
+
+inline ConnectionEventCode connectionEventCode(NabtoDeviceConnectionEvent event)
+{
+    if (event == NABTO_DEVICE_CONNECTION_EVENT_OPENED) {
+        return CONNECTION_EVENT_OPENED;
+    } else if (event == NABTO_DEVICE_CONNECTION_EVENT_CLOSED) {
+        return CONNECTION_EVENT_CLOSED;
+    } else if (event == NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED) {
+        return CONNECTION_EVENT_CHANNEL_CHANGED;
+    }
+    return CONNECTION_EVENT_UNKNOWN;
+}
+
+inline DeviceEventCode deviceEventCode(NabtoDeviceEvent event)
+{
+    if (event == NABTO_DEVICE_EVENT_ATTACHED) {
+        return DEVICE_EVENT_ATTACHED;
+    } else if (event == NABTO_DEVICE_EVENT_DETACHED) {
+        return DEVICE_EVENT_DETACHED;
+    } else if (event == NABTO_DEVICE_EVENT_CLOSED) {
+        return DEVICE_EVENT_CLOSED;
+    } else if (event == NABTO_DEVICE_EVENT_UNKNOWN_FINGERPRINT) {
+        return DEVICE_EVENT_UNKNOWN_FINGERPRINT;
+    } else if (event == NABTO_DEVICE_EVENT_WRONG_PRODUCT_ID) {
+        return DEVICE_EVENT_WRONG_PRODUCT_ID;
+    } else if (event == NABTO_DEVICE_EVENT_WRONG_DEVICE_ID) {
+        return DEVICE_EVENT_WRONG_DEVICE_ID;
+    }
+    return DEVICE_EVENT_UNKNOWN;
+}
+
+// CoAP methods are passed as their NabtoDeviceCoapMethod value.
+inline bool coapMethodFromValue(Napi::Value value, NabtoDeviceCoapMethod* method)
+{
+    if (!value.IsNumber()) {
+        return false;
+    }
+    int32_t m = value.As<Napi::Number>().Int32Value();
+    if (m < NABTO_DEVICE_COAP_GET || m > NABTO_DEVICE_COAP_DELETE) {
+        return false;
+    }
+    *method = static_cast<NabtoDeviceCoapMethod>(m);
+    return true;
+}
+
+inline Napi::Object constantsObject(Napi::Env env)
+{
+    Napi::Object c = Napi::Object::New(env);
+    c.Set("CONNECTION_EVENT_OPENED", Napi::Number::New(env, CONNECTION_EVENT_OPENED));
+    c.Set("CONNECTION_EVENT_CLOSED", Napi::Number::New(env, CONNECTION_EVENT_CLOSED));
+    c.Set("CONNECTION_EVENT_CHANNEL_CHANGED", Napi::Number::New(env, CONNECTION_EVENT_CHANNEL_CHANGED));
+    c.Set("DEVICE_EVENT_ATTACHED", Napi::Number::New(env, DEVICE_EVENT_ATTACHED));
+    c.Set("DEVICE_EVENT_DETACHED", Napi::Number::New(env, DEVICE_EVENT_DETACHED));
+    c.Set("DEVICE_EVENT_CLOSED", Napi::Number::New(env, DEVICE_EVENT_CLOSED));
+    c.Set("DEVICE_EVENT_UNKNOWN_FINGERPRINT", Napi::Number::New(env, DEVICE_EVENT_UNKNOWN_FINGERPRINT));
+    c.Set("DEVICE_EVENT_WRONG_PRODUCT_ID", Napi::Number::New(env, DEVICE_EVENT_WRONG_PRODUCT_ID));
+    c.Set("DEVICE_EVENT_WRONG_DEVICE_ID", Napi::Number::New(env, DEVICE_EVENT_WRONG_DEVICE_ID));
+    c.Set("COAP_GET", Napi::Number::New(env, NABTO_DEVICE_COAP_GET));
+    c.Set("COAP_POST", Napi::Number::New(env, NABTO_DEVICE_COAP_POST));
+    c.Set("COAP_PUT", Napi::Number::New(env, NABTO_DEVICE_COAP_PUT));
+    c.Set("COAP_DELETE", Napi::Number::New(env, NABTO_DEVICE_COAP_DELETE));
+    return c;
+}
@@ -2,54 +2,236 @@
 
 #include <napi.h>
 #include <nabto/nabto_device.h>
+#include <uv.h>
+#include <atomic>
+#include <vector>
+
+class FutureContext;
+
+// Per device owner of the resources shared by all FutureContexts: a pool of
+// NabtoDeviceFutures and a completion queue which resolved futures are posted to
+// from the SDK thread. The queue is a lock free intrusive stack drained by a
+// single uv_async_t, so all completions which arrived since the last event loop
+// tick are handled in one pass on the JS thread, no matter which operation
+// (CoAP request, stream read, write, event) they belong to.
+//
+// The dispatcher is reference counted by the NodeNabtoDevice and by every live
+// FutureContext, and frees the NabtoDevice when the last reference is gone, so
+// futures are never freed after the device.
+//
+// Everything except post() must be called on the JS thread.
+class FutureDispatcher
+{
+public:
+    FutureDispatcher(NabtoDevice *device, Napi::Env env)
+    : device_(device), env_(env), asyncContext_(env, "FutureDispatcher")
+    {
+        uv_loop_t* loop;
+        napi_get_uv_event_loop(env, &loop);
+        async_ = new uv_async_t;
+        async_->data = this;
+        uv_async_init(loop, async_, FutureDispatcher::onAsync);
+        // Only keep the event loop alive while some operation is outstanding.
+        uv_unref(reinterpret_cast<uv_handle_t*>(async_));
+        napi_add_env_cleanup_hook(env, FutureDispatcher::onEnvCleanup, this);
+    }
+
+    NabtoDevice* getDevice()
+    {
+        return device_;
+    }
+
+    void ref()
+    {
+        refCount_++;
+    }
+
+    void unref()
+    {
+        if (--refCount_ > 0) {
+            return;
+        }
+        for (auto f : freeFutures_) {
+            nabto_device_future_free(f);
+        }
+        freeFutures_.clear();
+        if (async_ != nullptr) {
+            napi_remove_env_cleanup_hook(env_, FutureDispatcher::onEnvCleanup, this);
+            closeAsync();
+        }
+        nabto_device_free(device_);
+        delete this;
+    }
+
+    NabtoDeviceFuture* acquireFuture()
+    {
+        if (freeFutures_.empty()) {
+            return nabto_device_future_new(device_);
+        }
+        NabtoDeviceFuture* f = freeFutures_.back();
+        freeFutures_.pop_back();
+        return f;
+    }
+
+    void releaseFuture(NabtoDeviceFuture* future)
+    {
+        if (freeFutures_.size() < MAX_POOLED_FUTURES) {
+            freeFutures_.push_back(future);
+        } else {
+            nabto_device_future_free(future);
+        }
+    }
+
+    // Contexts waiting for a future count as active, and the event loop is kept
+    // alive while any context is active.
+    void addActive()
+    {
+        if (activeCount_++ == 0 && async_ != nullptr) {
+            uv_ref(reinterpret_cast<uv_handle_t*>(async_));
+        }
+    }
+
+    void removeActive()
+    {
+        if (--activeCount_ == 0 && async_ != nullptr) {
+            uv_unref(reinterpret_cast<uv_handle_t*>(async_));
+        }
+    }
+
+    // Called from the SDK thread to have context->complete() run on the JS
+    // thread. A context must not be posted again before it has completed.
+    void post(FutureContext* context);
+
+    // CoAP and authorization requests handed to JS which are not freed yet.
+    size_t liveCoapRequests = 0;
+    size_t liveAuthRequests = 0;
+
+private:
+    static const size_t MAX_POOLED_FUTURES = 256;
+
+    static void onAsync(uv_async_t* handle)
+    {
+        static_cast<FutureDispatcher*>(handle->data)->drain();
+    }
+
+    static void onEnvCleanup(void* data)
+    {
+        auto self = static_cast<FutureDispatcher*>(data);
+        // Once the device is stopped no more completions are posted, so the
+        // handle can be closed before the loop goes away. Contexts still
+        // alive at this point are never completed.
+        nabto_device_stop(self->device_);
+        self->closeAsync();
+    }
+
+    void closeAsync()
+    {
+        uv_close(reinterpret_cast<uv_handle_t*>(async_), [](uv_handle_t* handle) {
+            delete reinterpret_cast<uv_async_t*>(handle);
+        });
+        async_ = nullptr;
+    }
+
+    void drain();
+
+    NabtoDevice* device_;
+    Napi::Env env_;
+    Napi::AsyncContext asyncContext_;
+    uv_async_t* async_;
+    std::atomic<FutureContext*> completed_{nullptr};
+    std::vector<NabtoDeviceFuture*> freeFutures_;
+    size_t refCount_ = 1;
+    size_t activeCount_ = 0;
+};
 
 class FutureContext
 {
 public:
-    FutureContext(NabtoDevice *device, Napi::Env env)
-    : future_(nabto_device_future_new(device)), device_(device), deferred_(Napi::Promise::Deferred::New(env))
+    FutureContext(FutureDispatcher *dispatcher, Napi::Env env)
+    : dispatcher_(dispatcher), future_(dispatcher->acquireFuture()), device_(dispatcher->getDevice()), env_(env), deferred_(Napi::Promise::Deferred::New(env))
     {
-        ttsf_ = TTSF::New(env, "TSFN", 0, 1, this, [](Napi::Env, void *, FutureContext *ctx)
-                          { delete ctx; });
+        dispatcher_->ref();
     }
 
     virtual ~FutureContext()
     {
-        nabto_device_future_free(future_);
+        setActive(false);
+        dispatcher_->releaseFuture(future_);
+        dispatcher_->unref();
     }
 
     void arm(bool repeatable) {
         repeatable_ = repeatable;
-        deferred_ = Napi::Promise::Deferred::New(deferred_.Env());
+        deferred_ = Napi::Promise::Deferred::New(env_);
+        setActive(true);
+        setFutureCallback();
+    }
+
+    // Registers the resolve callback without creating a new promise, so it is
+    // safe to call from the SDK thread.
+    void setFutureCallback() {
         nabto_device_future_set_callback(future_, FutureContext::futureCallback, this);
     }
 
+    // Stops a repeatable context. The context is deleted once it no longer waits
+    // for a future, so the caller must not use it after this.
     void stop() {
-        ttsf_.Release();
+        stopped_ = true;
+        cancel();
+        if (!active_) {
+            delete this;
+        }
+    }
+
+    // Makes an outstanding future resolve so a stopped context can be deleted.
+    virtual void cancel()
+    {
     }
 
-    static void CallJS(Napi::Env env, Napi::Function callback, FutureContext *context, void **data)
+    // Whether the context should be deleted after complete() has run.
+    virtual bool done()
     {
-        if (context->ec_ == NABTO_DEVICE_EC_OK)
+        return !repeatable_ || stopped_;
+    }
+
+    // Value the promise is resolved with when the future resolves OK.
+    virtual Napi::Value resolveValue(Napi::Env env)
+    {
+        return env.Undefined();
+    }
+
+    // Called on the JS thread for each resolved future. Settles the promise by default.
+    virtual void complete(Napi::Env env)
+    {
+        setActive(false);
+        if (ec_ == NABTO_DEVICE_EC_OK)
         {
-            context->deferred_.Resolve(env.Undefined());
+            deferred_.Resolve(resolveValue(env));
         }
         else
         {
-            context->deferred_.Reject(Napi::Error::New(env, nabto_device_error_get_message(context->ec_)).Value());
+            deferred_.Reject(createError(env, ec_));
         }
     }
-    typedef Napi::TypedThreadSafeFunction<FutureContext, void *, FutureContext::CallJS> TTSF;
+
+    // Called on the SDK thread when the future resolves. Schedules complete() on the JS thread by default.
+    virtual void resolved(NabtoDeviceError ec)
+    {
+        ec_ = ec;
+        dispatcher_->post(this);
+    }
+
+    static Napi::Value createError(Napi::Env env, NabtoDeviceError ec)
+    {
+        Napi::Error err = Napi::Error::New(env, nabto_device_error_get_message(ec));
+        err.Set("code", nabto_device_error_get_string(ec));
+        return err.Value();
+    }
 
     static void futureCallback(NabtoDeviceFuture *future, NabtoDeviceError ec, void *userData)
     {
         auto ctx = static_cast<FutureContext *>(userData);
-        ctx->ec_ = ec;
-
-        ctx->ttsf_.NonBlockingCall();
-        if (!ctx->repeatable_) {
-            ctx->stop();
-        }
+        ctx->resolved(ec);
     }
 
     Napi::Value Promise()
@@ -57,10 +239,88 @@ public:
         return deferred_.Promise();
     }
 
+    FutureDispatcher* dispatcher_;
+    // Link in the dispatcher completion queue.
+    FutureContext* nextCompleted_ = nullptr;
     NabtoDeviceFuture* future_;
     NabtoDevice* device_;
-    TTSF ttsf_;
+    Napi::Env env_;
     Napi::Promise::Deferred deferred_;
     NabtoDeviceError ec_;
     bool repeatable_ = false;
+
+protected:
+    // A background context waits for its future without keeping the event loop alive.
+    bool background_ = false;
+
+    bool isStopped()
+    {
+        return stopped_;
+    }
+
+    void setActive(bool active)
+    {
+        if (active == active_) {
+            return;
+        }
+        active_ = active;
+        if (background_) {
+            return;
+        }
+        if (active) {
+            dispatcher_->addActive();
+        } else {
+            dispatcher_->removeActive();
+        }
+    }
+
+private:
+    bool active_ = false;
+    bool stopped_ = false;
 };
+
+inline void FutureDispatcher::post(FutureContext* context)
+{
+    FutureContext* head = completed_.load(std::memory_order_relaxed);
+    do {
+        context->nextCompleted_ = head;
+    } while (!completed_.compare_exchange_weak(head, context, std::memory_order_release, std::memory_order_relaxed));
+    if (head == nullptr) {
+        // The queue was empty, so no wakeup is pending for what is queued now.
+        uv_async_send(async_);
+    }
+}
+
+inline void FutureDispatcher::drain()
+{
+    FutureContext* list = completed_.exchange(nullptr, std::memory_order_acquire);
+    // The queue is a stack, reverse it to complete in the order things resolved.
+    FutureContext* ordered = nullptr;
+    while (list != nullptr) {
+        FutureContext* next = list->nextCompleted_;
+        list->nextCompleted_ = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    // Keep the dispatcher alive if the last context is deleted in the loop.
+    ref();
+    {
+        Napi::HandleScope handleScope(env_);
+        // Promise reactions queued by the completions run when the scope closes.
+        Napi::CallbackScope callbackScope(env_, asyncContext_);
+        while (ordered != nullptr) {
+            FutureContext* context = ordered;
+            ordered = context->nextCompleted_;
+            context->nextCompleted_ = nullptr;
+            context->complete(env_);
+            if (context->done()) {
+                delete context;
+            }
+            if (env_.IsExceptionPending()) {
+                napi_fatal_exception(env_, env_.GetAndClearPendingException().Value());
+            }
+        }
+    }
+    unref();
+}
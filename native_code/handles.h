@@ -0,0 +1,74 @@
+#pragma once
+
+#include <napi.h>
+#include <nabto/nabto_device.h>
+
+// Values which identify SDK objects on the JS side. Connection refs are 64 bit
+// and are passed as BigInt so they survive the round trip exactly. Pointers to
+// SDK objects handed to JS to construct their wrappers are passed as opaque
+// Externals, which JS cannot forge from a number. A handle is tagged with the
+// type of the object and can only be taken once, as the wrapper taking it owns
+// the object.
+
+inline Napi::Value connectionRefValue(Napi::Env env, NabtoDeviceConnectionRef ref)
+{
+    return Napi::BigInt::New(env, (uint64_t)ref);
+}
+
+// Accepts a BigInt, or an integral Number for refs obtained before refs were BigInts.
+inline bool connectionRefFromValue(Napi::Value value, NabtoDeviceConnectionRef* ref)
+{
+    if (value.IsBigInt()) {
+        bool lossless;
+        *ref = value.As<Napi::BigInt>().Uint64Value(&lossless);
+        return lossless;
+    }
+    if (value.IsNumber()) {
+        double d = value.As<Napi::Number>().DoubleValue();
+        if (d < 0 || d != (double)(uint64_t)d) {
+            return false;
+        }
+        *ref = (uint64_t)d;
+        return true;
+    }
+    return false;
+}
+
+// One tag per handle type, told apart by address.
+template<typename T>
+struct HandleTag {
+    static const char tag;
+};
+
+template<typename T>
+const char HandleTag<T>::tag = 0;
+
+struct HandleBox {
+    const char* tag;
+    void* handle;
+};
+
+template<typename T>
+Napi::Value handleValue(Napi::Env env, T* handle)
+{
+    return Napi::External<HandleBox>::New(env, new HandleBox{&HandleTag<T>::tag, handle}, [](Napi::Env, HandleBox* box) {
+        delete box;
+    });
+}
+
+// Takes the object out of a handle. Returns nullptr if the value is not a
+// handle of type T or the handle was already taken.
+template<typename T>
+T* takeHandle(Napi::Value value)
+{
+    if (!value.IsExternal()) {
+        return nullptr;
+    }
+    HandleBox* box = value.As<Napi::External<HandleBox>>().Data();
+    if (box == nullptr || box->tag != &HandleTag<T>::tag) {
+        return nullptr;
+    }
+    T* handle = static_cast<T*>(box->handle);
+    box->handle = nullptr;
+    return handle;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <napi.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Log-linear latency histogram in the style of HdrHistogram. Values are in
+// microseconds and are counted in buckets per power of two with 16 linear
+// sub-buckets each, so a reported percentile is within about 6% of the true
+// value. Values above 2^36 us (about 19 hours) are counted in the last bucket.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() : counts_(BUCKETS, 0)
+    {
+    }
+
+    void record(uint64_t us)
+    {
+        counts_[index(us)]++;
+        count_++;
+        sum_ += us;
+        min_ = count_ == 1 ? us : std::min(min_, us);
+        max_ = std::max(max_, us);
+    }
+
+    // Upper bound of the bucket containing the p'th percentile, p in [0, 100].
+    uint64_t percentile(double p) const
+    {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)(p / 100.0 * count_ + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            seen += counts_[i];
+            if (seen >= target) {
+                return std::min(upperBound(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    void reset()
+    {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = 0;
+        sum_ = 0;
+        min_ = 0;
+        max_ = 0;
+    }
+
+    // Summary as { count, min, max, mean, p50, p90, p99, p999 }, in microseconds.
+    Napi::Object toObject(Napi::Env env) const
+    {
+        Napi::Object o = Napi::Object::New(env);
+        o.Set("count", Napi::Number::New(env, count_));
+        o.Set("min", Napi::Number::New(env, min_));
+        o.Set("max", Napi::Number::New(env, max_));
+        o.Set("mean", Napi::Number::New(env, count_ == 0 ? 0 : (double)sum_ / count_));
+        o.Set("p50", Napi::Number::New(env, percentile(50)));
+        o.Set("p90", Napi::Number::New(env, percentile(90)));
+        o.Set("p99", Napi::Number::New(env, percentile(99)));
+        o.Set("p999", Napi::Number::New(env, percentile(99.9)));
+        return o;
+    }
+
+    static uint64_t nowUs()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    static const int SUB_BITS = 4;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS = 36;
+    static const size_t BUCKETS = SUB_BUCKETS + (MAX_BITS - SUB_BITS) * SUB_BUCKETS;
+
+    static size_t index(uint64_t v)
+    {
+        if (v < SUB_BUCKETS) {
+            return v;
+        }
+        int msb = 0;
+        while ((v >> (msb + 1)) != 0) {
+            msb++;
+        }
+        size_t shift = msb - SUB_BITS;
+        size_t i = SUB_BUCKETS + shift * SUB_BUCKETS + ((v >> shift) - SUB_BUCKETS);
+        return std::min(i, BUCKETS - 1);
+    }
+
+    static uint64_t upperBound(size_t i)
+    {
+        if (i < SUB_BUCKETS) {
+            return i;
+        }
+        size_t shift = (i - SUB_BUCKETS) / SUB_BUCKETS;
+        size_t sub = (i - SUB_BUCKETS) % SUB_BUCKETS;
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint32_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = 0;
+    uint64_t max_ = 0;
+};
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <napi.h>
+#include <nabto/nabto_device.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class LogMessage {
+ public:
+    LogMessage(const char* message, NabtoDeviceLogLevel severity)
+      : message_(message), severity_(severity)
+    {
+    }
+
+    std::string message_;
+    NabtoDeviceLogLevel severity_;
+};
+
+class LogQueue;
+void CallJs(Napi::Env env, Napi::Function callback, LogQueue* queue, void* data);
+typedef Napi::TypedThreadSafeFunction<LogQueue, void, CallJs> LogCallbackFunction;
+
+// Log lines from the SDK waiting to be delivered to the JS log callback. Lines
+// are queued from SDK threads and the JS thread is only woken when the queue
+// goes from empty to non empty, so everything logged since the last delivery is
+// passed to JS as one array. Lines arriving while the queue is full are counted
+// and dropped.
+//
+// The queue is the context of the thread safe function and is deleted by its
+// finalizer, so it outlives any queued call. SDK threads reach it through a
+// std::shared_ptr created by share(), which releases the thread safe function
+// once the last reference is gone, so no thread can push after the release.
+class LogQueue
+{
+public:
+    static const size_t DEFAULT_CAPACITY = 4096;
+
+    LogQueue(size_t capacity) : capacity_(capacity)
+    {
+    }
+
+    void setCallback(LogCallbackFunction callback)
+    {
+        callback_ = callback;
+    }
+
+    LogCallbackFunction& getCallback()
+    {
+        return callback_;
+    }
+
+    static std::shared_ptr<LogQueue> share(LogQueue* queue)
+    {
+        return std::shared_ptr<LogQueue>(queue, [](LogQueue* q) { q->callback_.Release(); });
+    }
+
+    // Called from SDK threads.
+    void push(NabtoDeviceLogMessage* log)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.size() >= capacity_) {
+                dropped_++;
+                return;
+            }
+            pending_.emplace_back(log->message, log->severity);
+            if (wakePending_) {
+                return;
+            }
+            wakePending_ = true;
+        }
+        callback_.NonBlockingCall();
+    }
+
+    // Called on the JS thread, takes everything queued so far.
+    std::vector<LogMessage> take()
+    {
+        std::vector<LogMessage> messages;
+        std::lock_guard<std::mutex> lock(mutex_);
+        messages.swap(pending_);
+        wakePending_ = false;
+        return messages;
+    }
+
+    uint64_t dropped()
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    LogCallbackFunction callback_;
+    size_t capacity_;
+    std::mutex mutex_;
+    std::vector<LogMessage> pending_;
+    bool wakePending_ = false;
+    std::atomic<uint64_t> dropped_{0};
+};
+
+class LogRing;
+void CallJsRecords(Napi::Env env, Napi::Function callback, LogRing* ring, void* data);
+typedef Napi::TypedThreadSafeFunction<LogRing, void, CallJsRecords> LogRecordCallbackFunction;
+
+// Log lines encoded as packed binary records in a ring buffer which is shared
+// with JS as one ArrayBuffer, so delivering a batch allocates nothing. Records
+// are appended from SDK threads, and the JS callback is called with
+// (ring, offset, length) for each contiguous run of records. The run is only
+// reused once the callback returns. Records which do not fit are dropped and
+// counted.
+//
+// A record is, little endian:
+//   u32 record length, u32 severity (NabtoDeviceLogLevel), f64 milliseconds
+//   since the epoch, u32 line, u16 module length, u16 file length, u32 message
+//   length, followed by the module, file and message bytes.
+// The SDK has no notion of modules, the module is the name of the directory
+// containing the source file.
+//
+// The ring is the context of the thread safe function and is deleted by its
+// finalizer on the JS thread. Like LogQueue it is shared with SDK threads through
+// share(). The ArrayBuffer owns the memory, so it stays valid for JS.
+class LogRing
+{
+public:
+    static const size_t HEADER_SIZE = 28;
+    static const size_t DEFAULT_CAPACITY = 1024 * 1024;
+    static const size_t MIN_CAPACITY = 4096;
+
+    LogRing(Napi::Env env, size_t capacity) : capacity_(capacity)
+    {
+        data_ = static_cast<uint8_t*>(malloc(capacity));
+        Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(env, data_, capacity, [](Napi::Env, void* data) { free(data); });
+        buffer_ = Napi::Persistent(buffer);
+    }
+
+    void setCallback(LogRecordCallbackFunction callback)
+    {
+        callback_ = callback;
+    }
+
+    LogRecordCallbackFunction& getCallback()
+    {
+        return callback_;
+    }
+
+    static std::shared_ptr<LogRing> share(LogRing* ring)
+    {
+        return std::shared_ptr<LogRing>(ring, [](LogRing* r) { r->callback_.Release(); });
+    }
+
+    Napi::ArrayBuffer getBuffer()
+    {
+        return buffer_.Value();
+    }
+
+    // Called from SDK threads.
+    void push(NabtoDeviceLogMessage* log)
+    {
+        const char* file = log->file != NULL ? log->file : "";
+        size_t fileLength = std::min(strlen(file), (size_t)UINT16_MAX);
+        const char* module;
+        size_t moduleLength;
+        moduleOf(file, fileLength, &module, &moduleLength);
+        size_t messageLength = strlen(log->message);
+        size_t length = HEADER_SIZE + moduleLength + fileLength + messageLength;
+        double now = std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            uint8_t* record = reserve(length);
+            if (record == nullptr) {
+                dropped_++;
+                return;
+            }
+            uint64_t time;
+            memcpy(&time, &now, sizeof(time));
+            putLe(record, length, 4);
+            putLe(record + 4, log->severity, 4);
+            putLe(record + 8, time, 8);
+            putLe(record + 16, log->line, 4);
+            putLe(record + 20, moduleLength, 2);
+            putLe(record + 22, fileLength, 2);
+            putLe(record + 24, messageLength, 4);
+            uint8_t* ptr = record + HEADER_SIZE;
+            memcpy(ptr, module, moduleLength);
+            ptr += moduleLength;
+            memcpy(ptr, file, fileLength);
+            ptr += fileLength;
+            memcpy(ptr, log->message, messageLength);
+            if (wakePending_) {
+                return;
+            }
+            wakePending_ = true;
+        }
+        callback_.NonBlockingCall();
+    }
+
+    // Called on the JS thread. Calls deliver(offset, length) for the records
+    // present now, releasing each run after it has been delivered.
+    template<typename F>
+    void deliver(F deliver)
+    {
+        size_t segments;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wakePending_ = false;
+            segments = wrapped_ ? 2 : 1;
+        }
+        for (size_t i = 0; i < segments; i++) {
+            size_t offset;
+            size_t end;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                offset = head_;
+                end = wrapped_ ? wrapEnd_ : tail_;
+            }
+            if (end > offset) {
+                deliver(offset, end - offset);
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            // The ring may have wrapped while the callback ran.
+            head_ = end;
+            if (wrapped_ && head_ == wrapEnd_) {
+                head_ = 0;
+                wrapped_ = false;
+            } else if (!wrapped_ && head_ == tail_) {
+                head_ = tail_ = 0;
+            }
+        }
+    }
+
+    uint64_t dropped()
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Space for a record of the given length, or nullptr if the ring is full.
+    // Data is [head_, tail_), or [head_, wrapEnd_) followed by [0, tail_) when wrapped.
+    uint8_t* reserve(size_t length)
+    {
+        size_t offset;
+        if (!wrapped_ && tail_ + length <= capacity_) {
+            offset = tail_;
+        } else if (!wrapped_ && length <= head_) {
+            wrapEnd_ = tail_;
+            wrapped_ = true;
+            offset = 0;
+        } else if (wrapped_ && tail_ + length <= head_) {
+            offset = tail_;
+        } else {
+            return nullptr;
+        }
+        tail_ = offset + length;
+        return data_ + offset;
+    }
+
+    static void moduleOf(const char* file, size_t fileLength, const char** module, size_t* moduleLength)
+    {
+        size_t end = fileLength;
+        while (end > 0 && file[end - 1] != '/' && file[end - 1] != '\\') {
+            end--;
+        }
+        if (end == 0) {
+            *module = file;
+            *moduleLength = 0;
+            return;
+        }
+        size_t start = end - 1;
+        while (start > 0 && file[start - 1] != '/' && file[start - 1] != '\\') {
+            start--;
+        }
+        *module = file + start;
+        *moduleLength = end - 1 - start;
+    }
+
+    static void putLe(uint8_t* p, uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; i++) {
+            p[i] = (uint8_t)(value >> (8 * i));
+        }
+    }
+
+    LogRecordCallbackFunction callback_;
+    Napi::Reference<Napi::ArrayBuffer> buffer_;
+    uint8_t* data_;
+    size_t capacity_;
+    std::mutex mutex_;
+    size_t head_ = 0;
+    size_t tail_ = 0;
+    size_t wrapEnd_ = 0;
+    bool wrapped_ = false;
+    bool wakePending_ = false;
+    std::atomic<uint64_t> dropped_{0};
+};
+
+// Mask of the severities at or above the level named like in nabto_device_set_log_level.
+inline uint32_t logSeverityMask(const std::string& level)
+{
+    if (level == "error") {
+        return NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR;
+    } else if (level == "warn") {
+        return NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR | NABTO_DEVICE_LOG_WARN;
+    } else if (level == "info") {
+        return NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR | NABTO_DEVICE_LOG_WARN | NABTO_DEVICE_LOG_INFO;
+    } else {
+        return NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR | NABTO_DEVICE_LOG_WARN | NABTO_DEVICE_LOG_INFO | NABTO_DEVICE_LOG_TRACE;
+    }
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+// Writes log lines to a file descriptor directly from the SDK thread which logs
+// them, without involving the JS thread. Lines are buffered and written when the
+// buffer is full, when a warning or worse is logged, and when the sink is
+// destroyed.
+//
+// A sink opened from a path owns the file and rotates it before a write would
+// take it past maxSize: path.(n-1) is renamed to path.n down to path -> path.1,
+// keeping maxFiles old files. A sink writing to a caller supplied fd never closes it.
+class LogFileSink
+{
+public:
+    enum Format { TEXT, JSON };
+
+    static const size_t BUFFER_SIZE = 64 * 1024;
+
+    // Returns nullptr with errno set if the file cannot be opened.
+    static LogFileSink* open(const std::string& path, Format format, size_t maxSize, size_t maxFiles)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return nullptr;
+        }
+        LogFileSink* sink = new LogFileSink(fd, format);
+        sink->path_ = path;
+        sink->maxSize_ = maxSize;
+        sink->maxFiles_ = maxFiles;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            sink->fileSize_ = st.st_size;
+        }
+        return sink;
+    }
+
+    LogFileSink(int fd, Format format) : fd_(fd), format_(format)
+    {
+        buffer_.reserve(BUFFER_SIZE);
+    }
+
+    ~LogFileSink()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flushLocked();
+        if (!path_.empty()) {
+            close(fd_);
+        }
+    }
+
+    // Called from SDK threads.
+    void write(NabtoDeviceLogMessage* log)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (format_ == JSON) {
+            appendJson(log);
+        } else {
+            appendText(log);
+        }
+        if (buffer_.size() >= BUFFER_SIZE || log->severity <= NABTO_DEVICE_LOG_WARN) {
+            flushLocked();
+        }
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flushLocked();
+    }
+
+private:
+    bool rotationDue(size_t pending)
+    {
+        return !path_.empty() && maxSize_ > 0 && fileSize_ > 0 && fileSize_ + pending > maxSize_;
+    }
+
+    void flushLocked()
+    {
+        if (buffer_.empty()) {
+            return;
+        }
+        if (rotationDue(buffer_.size())) {
+            rotate();
+        }
+        const char* data = buffer_.data();
+        size_t left = buffer_.size();
+        while (left > 0) {
+            ssize_t written = ::write(fd_, data, left);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Nowhere to report this, the lines are lost.
+                break;
+            }
+            data += written;
+            left -= written;
+            fileSize_ += written;
+        }
+        buffer_.clear();
+    }
+
+    void rotate()
+    {
+        if (maxFiles_ == 0) {
+            unlink(path_.c_str());
+        } else {
+            for (size_t i = maxFiles_ - 1; i > 0; i--) {
+                rename(rotatedPath(i).c_str(), rotatedPath(i + 1).c_str());
+            }
+            rename(path_.c_str(), rotatedPath(1).c_str());
+        }
+        int fd = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            // Keep writing to the renamed file rather than losing lines.
+            return;
+        }
+        close(fd_);
+        fd_ = fd;
+        fileSize_ = 0;
+    }
+
+    std::string rotatedPath(size_t n)
+    {
+        return path_ + "." + std::to_string(n);
+    }
+
+    void appendTimestamp()
+    {
+        auto now = std::chrono::system_clock::now();
+        time_t seconds = std::chrono::system_clock::to_time_t(now);
+        long millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+        struct tm tm;
+        gmtime_r(&seconds, &tm);
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, millis);
+        buffer_.append(buf);
+    }
+
+    void appendText(NabtoDeviceLogMessage* log)
+    {
+        appendTimestamp();
+        buffer_.append(" [");
+        buffer_.append(nabto_device_log_severity_as_string(log->severity));
+        buffer_.append("] ");
+        if (log->file != NULL) {
+            buffer_.append(log->file);
+            buffer_.append(":");
+            buffer_.append(std::to_string(log->line));
+            buffer_.append(" ");
+        }
+        buffer_.append(log->message);
+        buffer_.append("\n");
+    }
+
+    void appendJson(NabtoDeviceLogMessage* log)
+    {
+        buffer_.append("{\"time\":\"");
+        appendTimestamp();
+        buffer_.append("\",\"severity\":\"");
+        buffer_.append(nabto_device_log_severity_as_string(log->severity));
+        buffer_.append("\"");
+        if (log->file != NULL) {
+            buffer_.append(",\"file\":");
+            appendJsonString(log->file);
+            buffer_.append(",\"line\":");
+            buffer_.append(std::to_string(log->line));
+        }
+        buffer_.append(",\"message\":");
+        appendJsonString(log->message);
+        buffer_.append("}\n");
+    }
+
+    void appendJsonString(const char* s)
+    {
+        buffer_.push_back('"');
+        for (; *s != 0; s++) {
+            unsigned char c = *s;
+            if (c == '"' || c == '\\') {
+                buffer_.push_back('\\');
+                buffer_.push_back(c);
+            } else if (c == '\n') {
+                buffer_.append("\\n");
+            } else if (c < 0x20) {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                buffer_.append(esc);
+            } else {
+                buffer_.push_back(c);
+            }
+        }
+        buffer_.push_back('"');
+    }
+
+    std::mutex mutex_;
+    int fd_;
+    Format format_;
+    std::string buffer_;
+    std::string path_;
+    size_t maxSize_ = 0;
+    size_t maxFiles_ = 0;
+    size_t fileSize_ = 0;
+};
@@ -7,7 +7,7 @@
 Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
   Napi::Object tmp = NodeNabtoDevice::Init(env, exports);
   tmp = CoapRequest::Init(env, exports);
-  tmp = CoapEndpoint::Init(env, exports);
+  tmp = CoapRouter::Init(env, exports);
   tmp = Stream::Init(env, exports);
   tmp = StreamListener::Init(env, exports);
   tmp = AuthRequest::Init(env, exports);
@@ -1,9 +1,12 @@
 #include "node_nabto_device.h"
 #include "future.h"
+#include "handles.h"
 
 #include <nabto/nabto_device.h>
 #include <nabto/nabto_device_experimental.h>
 
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 
 std::vector<uint8_t> bytesFromHex(std::string hex);
@@ -11,7 +14,7 @@ std::vector<uint8_t> bytesFromHex(std::string hex);
 class StartFutureContext : public FutureContext
 {
 public:
-  StartFutureContext(NabtoDevice *device, Napi::Env env) : FutureContext(device, env)
+  StartFutureContext(FutureDispatcher* dispatcher, Napi::Env env) : FutureContext(dispatcher, env)
   {
     nabto_device_start(device_, future_);
     arm(false);
@@ -29,6 +32,9 @@ Napi::Object NodeNabtoDevice::Init(Napi::Env env, Napi::Object exports) {
         InstanceMethod("createPrivateKey", &NodeNabtoDevice::CreatePrivateKey),
         InstanceMethod("setLogLevel", &NodeNabtoDevice::SetLogLevel),
         InstanceMethod("setLogCallback", &NodeNabtoDevice::SetLogCallback),
+        InstanceMethod("getDroppedLogMessages", &NodeNabtoDevice::GetDroppedLogMessages),
+        InstanceMethod("setLogSink", &NodeNabtoDevice::SetLogSink),
+        InstanceMethod("setLogRecordCallback", &NodeNabtoDevice::SetLogRecordCallback),
         InstanceMethod("stop", &NodeNabtoDevice::Stop),
         InstanceMethod("start", &NodeNabtoDevice::Start),
         InstanceMethod("getConfiguration", &NodeNabtoDevice::GetConfiguration),
@@ -38,6 +44,7 @@ Napi::Object NodeNabtoDevice::Init(Napi::Env env, Napi::Object exports) {
         InstanceMethod("notifyConnectionEvent", &NodeNabtoDevice::NotifyConnectionEvent),
         InstanceMethod("getCurrentConnectionEvent", &NodeNabtoDevice::GetCurrentConnectionEvent),
         InstanceMethod("getCurrentConnectionRef", &NodeNabtoDevice::GetCurrentConnectionRef),
+        InstanceMethod("connectionGetInfo", &NodeNabtoDevice::ConnectionGetInfo),
         InstanceMethod("connectionGetClientFingerprint", &NodeNabtoDevice::ConnectionGetClientFingerprint),
         InstanceMethod("connectionIsLocal", &NodeNabtoDevice::ConnectionIsLocal),
         InstanceMethod("connectionIsPasswordAuthenticated", &NodeNabtoDevice::ConnectionIsPasswordAuthenticated),
@@ -47,6 +54,7 @@ Napi::Object NodeNabtoDevice::Init(Napi::Env env, Napi::Object exports) {
         InstanceMethod("createServerConnectToken", &NodeNabtoDevice::CreateServerConnectToken),
         InstanceMethod("addServerConnectToken", &NodeNabtoDevice::AddServerConnectToken),
         InstanceMethod("areServerConnectTokensSync", &NodeNabtoDevice::AreServerConnectTokensSync),
+        InstanceMethod("getLiveRequestCounts", &NodeNabtoDevice::GetLiveRequestCounts),
         InstanceMethod("addTcpTunnelService", &NodeNabtoDevice::AddTcpTunnelService),
         InstanceMethod("removeTcpTunnelService", &NodeNabtoDevice::RemoveTcpTunnelService),
         InstanceMethod("setRawPrivateKey", &NodeNabtoDevice::SetRawPrivateKey),
@@ -57,6 +65,7 @@ Napi::Object NodeNabtoDevice::Init(Napi::Env env, Napi::Object exports) {
   env.SetInstanceData(constructor);
 
   exports.Set("NabtoDevice", func);
+  exports.Set("constants", constantsObject(env));
   return exports;
 }
 
@@ -64,12 +73,26 @@ NodeNabtoDevice::NodeNabtoDevice(const Napi::CallbackInfo& info)
     : Napi::ObjectWrap<NodeNabtoDevice>(info) {
   devEvents_ = NULL;
   connEvents_ = NULL;
+  logMask_ = logSeverityMask("trace");
+  droppedLogMessages_ = 0;
   nabtoDevice_ = nabto_device_new();
+  dispatcher_ = new FutureDispatcher(nabtoDevice_, info.Env());
+  connInfo_ = new ConnectionInfoCache(dispatcher_, info.Env());
 }
 
 NodeNabtoDevice::~NodeNabtoDevice()
 {
-    nabto_device_free(nabtoDevice_);
+    if (connInfo_ != NULL) {
+      connInfo_->stop();
+    }
+    // Resolves all outstanding futures. The dispatcher frees the device once
+    // the contexts waiting for them are gone.
+    nabto_device_stop(nabtoDevice_);
+    nabto_device_set_log_callback(nabtoDevice_, NULL, NULL);
+    releaseLogQueue();
+    releaseLogRing();
+    std::atomic_store(&logSink_, std::shared_ptr<LogFileSink>());
+    dispatcher_->unref();
 }
 
 void NodeNabtoDevice::Finalize(Napi::Env env)
@@ -80,21 +103,27 @@ void NodeNabtoDevice::Stop(const Napi::CallbackInfo& info)
 {
   if (devEvents_ != NULL) {
     devEvents_->stop();
+    devEvents_ = NULL;
   }
   if (connEvents_ != NULL) {
     connEvents_->stop();
+    connEvents_ = NULL;
+  }
+  if (connInfo_ != NULL) {
+    connInfo_->stop();
+    connInfo_ = NULL;
   }
   nabto_device_stop(nabtoDevice_);
   nabto_device_set_log_callback(nabtoDevice_, NULL, NULL);
-  if (logCallback_ != nullptr)
-  {
-    logCallback_.Release();
-  }
+  releaseLogQueue();
+  releaseLogRing();
+  // Flushes and closes the sink.
+  std::atomic_store(&logSink_, std::shared_ptr<LogFileSink>());
 }
 
 Napi::Value NodeNabtoDevice::Start(const Napi::CallbackInfo& info)
 {
-  StartFutureContext* sfc = new StartFutureContext(nabtoDevice_, info.Env());
+  StartFutureContext* sfc = new StartFutureContext(dispatcher_, info.Env());
   return sfc->Promise();
 }
 
@@ -383,12 +412,20 @@ Napi::Value NodeNabtoDevice::AreServerConnectTokensSync(const Napi::CallbackInfo
   return Napi::Boolean::New(info.Env(), true);
 }
 
+Napi::Value NodeNabtoDevice::GetLiveRequestCounts(const Napi::CallbackInfo& info)
+{
+  Napi::Object counts = Napi::Object::New(info.Env());
+  counts.Set("coap", Napi::Number::New(info.Env(), dispatcher_->liveCoapRequests));
+  counts.Set("authorization", Napi::Number::New(info.Env(), dispatcher_->liveAuthRequests));
+  return counts;
+}
+
 
 /************ DEVICE EVENTS *********/
 Napi::Value NodeNabtoDevice::NotifyDeviceEvent(const Napi::CallbackInfo& info)
 {
   if (devEvents_ == NULL) {
-    devEvents_ = new DeviceEventFutureContext(nabtoDevice_, info.Env());
+    devEvents_ = new DeviceEventFutureContext(dispatcher_, info.Env());
   } else {
     devEvents_->rearm();
   }
@@ -397,7 +434,11 @@ Napi::Value NodeNabtoDevice::NotifyDeviceEvent(const Napi::CallbackInfo& info)
 
 Napi::Value NodeNabtoDevice::GetCurrentDeviceEvent(const Napi::CallbackInfo& info)
 {
-  return Napi::String::New(info.Env(), devEvents_->getEventString());
+  if (devEvents_ == NULL) {
+    // Stopped after the event resolved but before it was read.
+    return info.Env().Undefined();
+  }
+  return Napi::Number::New(info.Env(), devEvents_->getEventCode());
 }
 
 
@@ -405,7 +446,7 @@ Napi::Value NodeNabtoDevice::GetCurrentDeviceEvent(const Napi::CallbackInfo& inf
 Napi::Value NodeNabtoDevice::NotifyConnectionEvent(const Napi::CallbackInfo& info)
 {
   if (connEvents_ == NULL) {
-    connEvents_ = new ConnectionEventFutureContext(nabtoDevice_, info.Env());
+    connEvents_ = new ConnectionEventFutureContext(dispatcher_, info.Env());
   } else {
     connEvents_->rearm();
   }
@@ -414,70 +455,115 @@ Napi::Value NodeNabtoDevice::NotifyConnectionEvent(const Napi::CallbackInfo& inf
 
 Napi::Value NodeNabtoDevice::GetCurrentConnectionEvent(const Napi::CallbackInfo& info)
 {
-  return Napi::String::New(info.Env(), connEvents_->getEventString());
+  if (connEvents_ == NULL) {
+    return info.Env().Undefined();
+  }
+  return Napi::Number::New(info.Env(), connEvents_->getEventCode());
 }
 
 Napi::Value NodeNabtoDevice::GetCurrentConnectionRef(const Napi::CallbackInfo& info)
 {
-  return Napi::Number::New(info.Env(), connEvents_->getConnectionRef());
+  if (connEvents_ == NULL) {
+    return info.Env().Undefined();
+  }
+  return connectionRefValue(info.Env(), connEvents_->getConnectionRef());
 }
 
 /*************** CONNECTIONS ************/
-Napi::Value NodeNabtoDevice::ConnectionGetClientFingerprint(const Napi::CallbackInfo& info)
+static bool connectionRefArg(const Napi::CallbackInfo& info, NabtoDeviceConnectionRef* ref)
 {
-  int length = info.Length();
-  if (length <= 0 || !info[0].IsNumber() ) {
+  if (info.Length() <= 0 || !connectionRefFromValue(info[0], ref)) {
     Napi::TypeError::New(info.Env(), "Invalid ConnectionRef").ThrowAsJavaScriptException();
+    return false;
+  }
+  return true;
+}
+
+// Goes through the cache while the device runs, and to the SDK after Stop.
+NabtoDeviceError NodeNabtoDevice::lookupConnection(NabtoDeviceConnectionRef ref, const ConnectionInfo** info)
+{
+  if (connInfo_ != NULL) {
+    return connInfo_->lookup(ref, info);
+  }
+  *info = &uncachedConnection_;
+  return ConnectionInfoCache::query(nabtoDevice_, ref, &uncachedConnection_);
+}
+
+// Returns { clientFingerprint, isLocal, isPasswordAuthenticated, passwordAuthenticationUsername? }.
+Napi::Value NodeNabtoDevice::ConnectionGetInfo(const Napi::CallbackInfo& info)
+{
+  Napi::Env env = info.Env();
+  NabtoDeviceConnectionRef ref;
+  if (!connectionRefArg(info, &ref)) {
+    return Napi::Value();
+  }
+  const ConnectionInfo* conn;
+  NabtoDeviceError ec = lookupConnection(ref, &conn);
+  if (ec != NABTO_DEVICE_EC_OK) {
+    Napi::TypeError::New(env, nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
     return Napi::Value();
   }
+  Napi::Object o = Napi::Object::New(env);
+  o.Set("clientFingerprint", conn->fingerprint);
+  o.Set("isLocal", conn->local);
+  o.Set("isPasswordAuthenticated", conn->passwordAuthenticated);
+  if (conn->passwordAuthenticated) {
+    o.Set("passwordAuthenticationUsername", conn->username);
+  }
+  return o;
+}
 
-  char* fp;
-  NabtoDeviceError ec = nabto_device_connection_get_client_fingerprint(nabtoDevice_, info[0].ToNumber().Uint32Value(), &fp);
+Napi::Value NodeNabtoDevice::ConnectionGetClientFingerprint(const Napi::CallbackInfo& info)
+{
+  NabtoDeviceConnectionRef ref;
+  if (!connectionRefArg(info, &ref)) {
+    return Napi::Value();
+  }
+  const ConnectionInfo* conn;
+  NabtoDeviceError ec = lookupConnection(ref, &conn);
   if (ec != NABTO_DEVICE_EC_OK) {
     Napi::TypeError::New(info.Env(), nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
     return Napi::Value();
   }
-  Napi::Value retVal = Napi::String::New(info.Env(), fp);
-  nabto_device_string_free(fp);
-  return retVal;
+  return Napi::String::New(info.Env(), conn->fingerprint);
 }
 
 Napi::Value NodeNabtoDevice::ConnectionIsLocal(const Napi::CallbackInfo& info)
 {
-  int length = info.Length();
-  if (length <= 0 || !info[0].IsNumber() ) {
-    Napi::TypeError::New(info.Env(), "Invalid ConnectionRef").ThrowAsJavaScriptException();
+  NabtoDeviceConnectionRef ref;
+  if (!connectionRefArg(info, &ref)) {
     return Napi::Value();
   }
-
-  bool local = nabto_device_connection_is_local(nabtoDevice_, info[0].ToNumber().Uint32Value());
-
+  const ConnectionInfo* conn;
+  bool local = lookupConnection(ref, &conn) == NABTO_DEVICE_EC_OK && conn->local;
   return Napi::Boolean::New(info.Env(), local);
 }
 
 Napi::Value NodeNabtoDevice::ConnectionIsPasswordAuthenticated(const Napi::CallbackInfo& info)
 {
-  int length = info.Length();
-  if (length <= 0 || !info[0].IsNumber() ) {
-    Napi::TypeError::New(info.Env(), "Invalid ConnectionRef").ThrowAsJavaScriptException();
+  NabtoDeviceConnectionRef ref;
+  if (!connectionRefArg(info, &ref)) {
     return Napi::Value();
   }
-
-  bool result = nabto_device_connection_is_password_authenticated(nabtoDevice_, info[0].ToNumber().Uint32Value());
-
+  const ConnectionInfo* conn;
+  bool result = lookupConnection(ref, &conn) == NABTO_DEVICE_EC_OK && conn->passwordAuthenticated;
   return Napi::Boolean::New(info.Env(), result);
 }
 
 Napi::Value NodeNabtoDevice::ConnectionGetPasswordAuthUsername(const Napi::CallbackInfo& info)
 {
-  int length = info.Length();
-  if (length <= 0 || !info[0].IsNumber() ) {
-    Napi::TypeError::New(info.Env(), "Invalid ConnectionRef").ThrowAsJavaScriptException();
+  NabtoDeviceConnectionRef ref;
+  if (!connectionRefArg(info, &ref)) {
     return Napi::Value();
   }
+  const ConnectionInfo* conn;
+  if (lookupConnection(ref, &conn) == NABTO_DEVICE_EC_OK && conn->passwordAuthenticated) {
+    return Napi::String::New(info.Env(), conn->username);
+  }
 
+  // Not authenticated, let the SDK report why.
   char* name;
-  NabtoDeviceError ec = nabto_device_connection_get_password_authentication_username(nabtoDevice_, info[0].ToNumber().Uint32Value(), &name);
+  NabtoDeviceError ec = nabto_device_connection_get_password_authentication_username(nabtoDevice_, ref, &name);
   if (ec != NABTO_DEVICE_EC_OK) {
     Napi::TypeError::New(info.Env(), nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
     return Napi::Value();
@@ -592,52 +678,212 @@ void NodeNabtoDevice::SetLogLevel(const Napi::CallbackInfo& info)
     return;
   }
 
-  NabtoDeviceError ec = nabto_device_set_log_level(nabtoDevice_, info[0].ToString().Utf8Value().c_str());
+  std::string level = info[0].ToString().Utf8Value();
+  NabtoDeviceError ec = nabto_device_set_log_level(nabtoDevice_, level.c_str());
   if (ec != NABTO_DEVICE_EC_OK) {
     Napi::Error::New(info.Env(), nabto_device_error_get_message(ec)).ThrowAsJavaScriptException();
+    return;
   }
+  logMask_ = logSeverityMask(level);
 }
 
 
-void CallJs(Napi::Env env, Napi::Function callback, Context *context, LogMessage *data)
+void CallJs(Napi::Env env, Napi::Function callback, LogQueue* queue, void* data)
 {
-
-  // Is the JavaScript environment still available to call into, eg. the TSFN is
-  // not aborted
-  if (env != nullptr) {
-    // On Node-API 5+, the `callback` parameter is optional; however, this example
-    // does ensure a callback is provided.
-    if (callback != nullptr) {
-        Napi::Object o = Napi::Object::New(callback.Env());
-        o.Set("message", data->message_);
-        o.Set("severity", data->severity_);
-      callback.Call({o});
-    }
+  // The environment is gone if the TSFN is aborted.
+  if (env == nullptr || callback == nullptr) {
+    return;
+  }
+  std::vector<LogMessage> messages = queue->take();
+  if (messages.empty()) {
+    return;
   }
-  if (data != nullptr) {
-    // We're finished with the data.
-    delete data;
+  Napi::Array batch = Napi::Array::New(env, messages.size());
+  for (size_t i = 0; i < messages.size(); i++) {
+    Napi::Object o = Napi::Object::New(env);
+    o.Set("message", messages[i].message_);
+    o.Set("severity", nabto_device_log_severity_as_string(messages[i].severity_));
+    batch.Set(i, o);
   }
+  callback.Call({batch});
 }
 
 void NodeNabtoDevice::LogCallback(NabtoDeviceLogMessage* log, void* userData)
 {
     NodeNabtoDevice* device = static_cast<NodeNabtoDevice*>(userData);
-
-    auto l = new LogMessage(log->message, nabto_device_log_severity_as_string(log->severity));
-    device->logCallback_.NonBlockingCall(l);
+    // Filter before anything is copied, so disabled levels cost nothing.
+    if ((log->severity & device->logMask_.load(std::memory_order_relaxed)) == 0) {
+        return;
+    }
+    std::shared_ptr<LogFileSink> sink = std::atomic_load(&device->logSink_);
+    if (sink) {
+        sink->write(log);
+    }
+    std::shared_ptr<LogQueue> queue = std::atomic_load(&device->logQueue_);
+    if (queue) {
+        queue->push(log);
+    }
+    std::shared_ptr<LogRing> ring = std::atomic_load(&device->logRing_);
+    if (ring) {
+        ring->push(log);
+    }
 }
 
 void NodeNabtoDevice::SetLogCallback(const Napi::CallbackInfo& info)
 {
-  //Napi::Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsFunction()) {
+    Napi::TypeError::New(info.Env(), "Function expected").ThrowAsJavaScriptException();
+    return;
+  }
   Napi::Function cb = info[0].As<Napi::Function>();
-  //Context *context = new Napi::Reference<Napi::Value>(Persistent(info.This()));
-  logCallback_ = LogCallbackFunction::New(cb.Env(), cb, "TSFN", 0, 1, NULL, [](Napi::Env, void*,
-        Context *ctx) { // Finalizer used to clean threads up
-        //delete ctx;
-      });
+  releaseLogQueue();
+
+  LogQueue* queue = new LogQueue(LogQueue::DEFAULT_CAPACITY);
+  queue->setCallback(LogCallbackFunction::New(cb.Env(), cb, "LogCallback", 0, 1, queue, [](Napi::Env, void*, LogQueue* queue) {
+    delete queue;
+  }));
+  std::atomic_store(&logQueue_, LogQueue::share(queue));
+  updateLogCallback();
+}
+
+// The SDK callback is only installed while there is somewhere to log to.
+void NodeNabtoDevice::updateLogCallback()
+{
+  if (std::atomic_load(&logQueue_) || std::atomic_load(&logRing_) || std::atomic_load(&logSink_)) {
     nabto_device_set_log_callback(nabtoDevice_, NodeNabtoDevice::LogCallback, this);
+  } else {
+    nabto_device_set_log_callback(nabtoDevice_, NULL, NULL);
+  }
+}
+
+// setLogSink({fd | path, format?, maxSize?, maxFiles?}) writes log lines
+// natively, setLogSink(undefined) flushes and removes the sink.
+void NodeNabtoDevice::SetLogSink(const Napi::CallbackInfo& info)
+{
+  Napi::Env env = info.Env();
+  if (info.Length() < 1 || info[0].IsUndefined() || info[0].IsNull()) {
+    std::atomic_store(&logSink_, std::shared_ptr<LogFileSink>());
+    updateLogCallback();
+    return;
+  }
+  if (!info[0].IsObject()) {
+    Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
+    return;
+  }
+  Napi::Object opts = info[0].ToObject();
+
+  LogFileSink::Format format = LogFileSink::TEXT;
+  if (opts.Has("format") && !opts.Get("format").IsUndefined()) {
+    std::string f = opts.Get("format").IsString() ? opts.Get("format").ToString().Utf8Value() : "";
+    if (f == "json") {
+      format = LogFileSink::JSON;
+    } else if (f != "text") {
+      Napi::TypeError::New(env, "format must be 'text' or 'json'").ThrowAsJavaScriptException();
+      return;
+    }
+  }
+
+  bool hasFd = opts.Has("fd") && opts.Get("fd").IsNumber();
+  bool hasPath = opts.Has("path") && opts.Get("path").IsString();
+  if (hasFd == hasPath) {
+    Napi::TypeError::New(env, "Exactly one of fd or path expected").ThrowAsJavaScriptException();
+    return;
+  }
+
+  LogFileSink* sink;
+  if (hasFd) {
+    sink = new LogFileSink(opts.Get("fd").As<Napi::Number>().Int32Value(), format);
+  } else {
+    size_t maxSize = 0;
+    size_t maxFiles = 5;
+    if (opts.Has("maxSize") && opts.Get("maxSize").IsNumber()) {
+      maxSize = opts.Get("maxSize").As<Napi::Number>().Int64Value();
+    }
+    if (opts.Has("maxFiles") && opts.Get("maxFiles").IsNumber()) {
+      maxFiles = opts.Get("maxFiles").As<Napi::Number>().Uint32Value();
+    }
+    std::string path = opts.Get("path").ToString().Utf8Value();
+    sink = LogFileSink::open(path, format, maxSize, maxFiles);
+    if (sink == nullptr) {
+      Napi::Error::New(env, "Could not open " + path + ": " + strerror(errno)).ThrowAsJavaScriptException();
+      return;
+    }
+  }
+  std::atomic_store(&logSink_, std::shared_ptr<LogFileSink>(sink));
+  updateLogCallback();
+}
+
+// SDK threads logging right now may still hold the queue. The thread safe
+// function is released when the last of them lets go, and the queue is deleted
+// once it has delivered what is queued.
+void NodeNabtoDevice::releaseLogQueue()
+{
+  std::shared_ptr<LogQueue> queue = std::atomic_exchange(&logQueue_, std::shared_ptr<LogQueue>());
+  if (queue) {
+    droppedLogMessages_ += queue->dropped();
+  }
+}
+
+void CallJsRecords(Napi::Env env, Napi::Function callback, LogRing* ring, void* data)
+{
+  if (env == nullptr || callback == nullptr) {
+    return;
+  }
+  Napi::ArrayBuffer buffer = ring->getBuffer();
+  ring->deliver([&](size_t offset, size_t length) {
+    if (!env.IsExceptionPending()) {
+      callback.Call({buffer, Napi::Number::New(env, offset), Napi::Number::New(env, length)});
+    }
+  });
+}
+
+// setLogRecordCallback(callback, capacity?) delivers log lines as binary
+// records, see LogRing. Returns the ring buffer.
+Napi::Value NodeNabtoDevice::SetLogRecordCallback(const Napi::CallbackInfo& info)
+{
+  Napi::Env env = info.Env();
+  if (info.Length() < 1 || !info[0].IsFunction()) {
+    Napi::TypeError::New(env, "Function expected").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+  size_t capacity = LogRing::DEFAULT_CAPACITY;
+  if (info.Length() > 1 && info[1].IsNumber()) {
+    capacity = std::max((size_t)info[1].As<Napi::Number>().Int64Value(), LogRing::MIN_CAPACITY);
+  }
+  Napi::Function cb = info[0].As<Napi::Function>();
+  releaseLogRing();
+
+  LogRing* ring = new LogRing(env, capacity);
+  ring->setCallback(LogRecordCallbackFunction::New(env, cb, "LogRecordCallback", 0, 1, ring, [](Napi::Env, void*, LogRing* ring) {
+    delete ring;
+  }));
+  Napi::ArrayBuffer buffer = ring->getBuffer();
+  std::atomic_store(&logRing_, LogRing::share(ring));
+  updateLogCallback();
+  return buffer;
+}
+
+// See releaseLogQueue().
+void NodeNabtoDevice::releaseLogRing()
+{
+  std::shared_ptr<LogRing> ring = std::atomic_exchange(&logRing_, std::shared_ptr<LogRing>());
+  if (ring) {
+    droppedLogMessages_ += ring->dropped();
+  }
+}
+
+Napi::Value NodeNabtoDevice::GetDroppedLogMessages(const Napi::CallbackInfo& info)
+{
+  uint64_t dropped = droppedLogMessages_;
+  std::shared_ptr<LogQueue> queue = std::atomic_load(&logQueue_);
+  if (queue) {
+    dropped += queue->dropped();
+  }
+  std::shared_ptr<LogRing> ring = std::atomic_load(&logRing_);
+  if (ring) {
+    dropped += ring->dropped();
+  }
+  return Napi::Number::New(info.Env(), dropped);
 }
 
 
@@ -673,7 +919,7 @@ std::vector<uint8_t> bytesFromHex(std::string hex)
 class IceFutureContext : public FutureContext
 {
 public:
-  IceFutureContext(NabtoDevice* device, std::string identifier, NabtoDeviceIceServersRequest* req, Napi::Env env) : FutureContext(device, env)
+  IceFutureContext(FutureDispatcher* dispatcher, std::string identifier, NabtoDeviceIceServersRequest* req, Napi::Env env) : FutureContext(dispatcher, env)
   {
     nabto_device_ice_servers_request_send(identifier.c_str(), req, future_);
     arm(false);
@@ -713,6 +959,7 @@ IceServersRequest::IceServersRequest(const Napi::CallbackInfo& info)
 
   NodeNabtoDevice* d = Napi::ObjectWrap<NodeNabtoDevice>::Unwrap(device.ToObject());
   device_ = d->getDevice();
+  dispatcher_ = d->getDispatcher();
 
   req_ = nabto_device_ice_servers_request_new(device_);
 
@@ -732,7 +979,7 @@ Napi::Value IceServersRequest::Send(const Napi::CallbackInfo& info)
     Napi::TypeError::New(env, "Expects 1 argument; identifier: string").ThrowAsJavaScriptException();
   }
 
-  IceFutureContext* ifc = new IceFutureContext(device_, info[0].ToString().Utf8Value().c_str(), req_, info.Env());
+  IceFutureContext* ifc = new IceFutureContext(dispatcher_, info[0].ToString().Utf8Value().c_str(), req_, info.Env());
   return ifc->Promise();
 }
 
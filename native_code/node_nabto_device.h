@@ -5,22 +5,15 @@
 #include <nabto/nabto_device_experimental.h>
 #include "future.h"
 #include "connection_events.h"
-
-class LogMessage {
- public:
-    LogMessage(std::string message, std::string severity)
-      : message_(message), severity_(severity)
-    {
-    }
-
-    std::string message_;
-    std::string severity_;
-};
+#include "constants.h"
+#include "log_queue.h"
+#include "log_sink.h"
+#include <memory>
 
 class DeviceEventFutureContext: public FutureContext
 {
   public:
-  DeviceEventFutureContext(NabtoDevice* device, Napi::Env env) : FutureContext(device, env)
+  DeviceEventFutureContext(FutureDispatcher* dispatcher, Napi::Env env) : FutureContext(dispatcher, env)
   {
     lis_ = nabto_device_listener_new(device_);
     NabtoDeviceError ec = nabto_device_device_events_init_listener(device_, lis_);
@@ -32,39 +25,27 @@ class DeviceEventFutureContext: public FutureContext
     arm(true);
   }
 
+  ~DeviceEventFutureContext() {
+    nabto_device_listener_free(lis_);
+  }
+
+  void cancel() {
+    nabto_device_listener_stop(lis_);
+  }
+
   void rearm() {
     nabto_device_listener_device_event(lis_, future_, &event_);
     arm(true);
   }
 
-// TODO: replace this with new embedded sdk api function for this.
-  std::string getEventString() {
-    if (event_ == NABTO_DEVICE_EVENT_ATTACHED) {
-        return "NABTO_DEVICE_EVENT_ATTACHED";
-    } else if (event_ == NABTO_DEVICE_EVENT_DETACHED) {
-        return "NABTO_DEVICE_EVENT_DETACHED";
-    } else if (event_ == NABTO_DEVICE_EVENT_CLOSED) {
-        return "NABTO_DEVICE_EVENT_CLOSED";
-    } else if (event_ == NABTO_DEVICE_EVENT_UNKNOWN_FINGERPRINT) {
-        return "NABTO_DEVICE_EVENT_UNKNOWN_FINGERPRINT";
-    } else if (event_ == NABTO_DEVICE_EVENT_WRONG_PRODUCT_ID) {
-        return "NABTO_DEVICE_EVENT_WRONG_PRODUCT_ID";
-    } else if (event_ == NABTO_DEVICE_EVENT_WRONG_DEVICE_ID) {
-        return "NABTO_DEVICE_EVENT_WRONG_DEVICE_ID";
-    } else {
-        return "";
-    }
+  DeviceEventCode getEventCode() {
+    return deviceEventCode(event_);
   }
 
   NabtoDeviceListener* lis_;
   NabtoDeviceEvent event_;
 };
 
-using Context = void;
-void CallJs(Napi::Env env, Napi::Function callback, Context *context, LogMessage *data);
-typedef Napi::TypedThreadSafeFunction<Context, LogMessage, CallJs> LogCallbackFunction;
-
-
 class NodeNabtoDevice : public Napi::ObjectWrap<NodeNabtoDevice> {
  public:
   static Napi::Object Init(Napi::Env env, Napi::Object exports);
@@ -75,15 +56,22 @@ class NodeNabtoDevice : public Napi::ObjectWrap<NodeNabtoDevice> {
   Napi::Value Start(const Napi::CallbackInfo& info);
 
   NabtoDevice* getDevice() { return nabtoDevice_; }
+  FutureDispatcher* getDispatcher() { return dispatcher_; }
 
  private:
   static void LogCallback(NabtoDeviceLogMessage* log, void* userData);
+  void releaseLogQueue();
+  void releaseLogRing();
+  void updateLogCallback();
 
   Napi::Value GetVersion(const Napi::CallbackInfo& info);
   void SetOptions(const Napi::CallbackInfo& info);
   Napi::Value CreatePrivateKey(const Napi::CallbackInfo& info);
   void SetLogLevel(const Napi::CallbackInfo& info);
   void SetLogCallback(const Napi::CallbackInfo& info);
+  Napi::Value GetDroppedLogMessages(const Napi::CallbackInfo& info);
+  void SetLogSink(const Napi::CallbackInfo& info);
+  Napi::Value SetLogRecordCallback(const Napi::CallbackInfo& info);
   Napi::Value GetConfiguration(const Napi::CallbackInfo& info);
   void SetBasestationAttach(const Napi::CallbackInfo& info);
   void MdnsAddSubtype(const Napi::CallbackInfo& info);
@@ -91,6 +79,7 @@ class NodeNabtoDevice : public Napi::ObjectWrap<NodeNabtoDevice> {
   Napi::Value CreateServerConnectToken(const Napi::CallbackInfo& info);
   void AddServerConnectToken(const Napi::CallbackInfo& info);
   Napi::Value AreServerConnectTokensSync(const Napi::CallbackInfo& info);
+  Napi::Value GetLiveRequestCounts(const Napi::CallbackInfo& info);
 
   // DEVICE EVENTS
   Napi::Value NotifyDeviceEvent(const Napi::CallbackInfo& info);
@@ -102,6 +91,8 @@ class NodeNabtoDevice : public Napi::ObjectWrap<NodeNabtoDevice> {
   Napi::Value GetCurrentConnectionRef(const Napi::CallbackInfo& info);
 
   // CONNECTION
+  NabtoDeviceError lookupConnection(NabtoDeviceConnectionRef ref, const ConnectionInfo** info);
+  Napi::Value ConnectionGetInfo(const Napi::CallbackInfo& info);
   Napi::Value ConnectionGetClientFingerprint(const Napi::CallbackInfo& info);
   Napi::Value ConnectionIsLocal(const Napi::CallbackInfo& info);
   Napi::Value ConnectionIsPasswordAuthenticated(const Napi::CallbackInfo& info);
@@ -115,9 +106,20 @@ class NodeNabtoDevice : public Napi::ObjectWrap<NodeNabtoDevice> {
   void SetRawPrivateKey(const Napi::CallbackInfo& info);
 
   NabtoDevice* nabtoDevice_;
-  LogCallbackFunction logCallback_;
+  FutureDispatcher* dispatcher_;
+  // Read by LogCallback on SDK threads, so only accessed through std::atomic_load/store.
+  std::shared_ptr<LogQueue> logQueue_;
+  std::shared_ptr<LogRing> logRing_;
+  // Severities passed on by LogCallback, see setLogLevel.
+  std::atomic<uint32_t> logMask_;
+  // Lines dropped by released log queues and rings.
+  uint64_t droppedLogMessages_;
+  // Read by LogCallback on SDK threads, so only accessed through std::atomic_load/store.
+  std::shared_ptr<LogFileSink> logSink_;
   DeviceEventFutureContext* devEvents_;
   ConnectionEventFutureContext* connEvents_;
+  ConnectionInfoCache* connInfo_;
+  ConnectionInfo uncachedConnection_;
 };
 
 
@@ -133,6 +135,7 @@ private:
   Napi::Value getResponse(const Napi::CallbackInfo& info);
 
   NabtoDevice* device_;
+  FutureDispatcher* dispatcher_;
   NabtoDeviceIceServersRequest* req_;
 
 };
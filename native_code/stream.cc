@@ -1,27 +1,90 @@
 #include "stream.h"
 #include "node_nabto_device.h"
 #include "future.h"
+#include "byte_range.h"
+#include "handles.h"
 
+// References the JS stream object so the native stream is not freed while the
+// accept is outstanding.
 class AcceptFutureContext : public FutureContext
 {
 public:
-    AcceptFutureContext(NabtoDevice* device, Napi::Env env, NabtoDeviceStream* stream) : FutureContext(device, env)
+    AcceptFutureContext(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Napi::Object owner) : FutureContext(dispatcher, env)
     {
+        ownerRef_ = Napi::Persistent(owner);
         nabto_device_stream_accept(stream, future_);
         arm(false);
     }
+
+private:
+    Napi::ObjectReference ownerRef_;
 };
 
-class WriteFutureContext : public FutureContext
+// Writes a list of buffers as one operation. The next chunk is written from
+// the SDK thread when the previous one completes, so the promise resolves once
+// when everything is written or on the first error. The chunk objects are
+// referenced until then so the SDK can write straight from their memory.
+class WriteFutureContext : public StreamWriteOperation
 {
 public:
-    WriteFutureContext(NabtoDevice* device, Napi::Env env, NabtoDeviceStream* stream, Napi::ArrayBuffer data) : FutureContext(device, env)
+    WriteFutureContext(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Stream* owner, std::vector<StreamWriteChunk> chunks, std::vector<Napi::Object> owners) : StreamWriteOperation(dispatcher, env, stream, owner)
     {
-        nabto_device_stream_write(stream, future_, data.Data(), data.ByteLength());
-        arm(false);
+        chunks_ = std::move(chunks);
+        for (auto& o : owners) {
+            owners_.push_back(Napi::Persistent(o));
+        }
     }
+
+    void start()
+    {
+        nabto_device_stream_write(stream_, future_, chunks_[0].data, chunks_[0].length);
+        setFutureCallback();
+    }
+
+    void resolved(NabtoDeviceError ec)
+    {
+        next_++;
+        if (ec == NABTO_DEVICE_EC_OK && next_ < chunks_.size()) {
+            nabto_device_stream_write(stream_, future_, chunks_[next_].data, chunks_[next_].length);
+            setFutureCallback();
+            return;
+        }
+        StreamWriteOperation::resolved(ec);
+    }
+
+private:
+    std::vector<StreamWriteChunk> chunks_;
+    std::vector<Napi::ObjectReference> owners_;
+    size_t next_ = 0;
 };
 
+// Reads a whole Number argument in [min, max]. Throws a TypeError if it is not a
+// Number and a RangeError if it is not an integer in range, and returns false.
+static bool sizeArg(Napi::Env env, Napi::Value value, const char* name, size_t min, size_t max, size_t* out)
+{
+    if (!value.IsNumber()) {
+        Napi::TypeError::New(env, std::string(name) + " must be a Number").ThrowAsJavaScriptException();
+        return false;
+    }
+    double d = value.ToNumber().DoubleValue();
+    if (!(d >= min && d <= max) || d != (double)(size_t)d) {
+        Napi::RangeError::New(env, std::string(name) + " must be an integer from " + std::to_string(min) + " to " + std::to_string(max)).ThrowAsJavaScriptException();
+        return false;
+    }
+    *out = (size_t)d;
+    return true;
+}
+
+// Returns NULL after throwing if the allocation fails.
+static void* allocReadBuffer(Napi::Env env, size_t length)
+{
+    void* buffer = malloc(length);
+    if (buffer == NULL) {
+        Napi::Error::New(env, "Out of memory allocating the read buffer").ThrowAsJavaScriptException();
+    }
+    return buffer;
+}
+
 Napi::Object StreamListener::Init(Napi::Env env, Napi::Object exports){
     Napi::Function func =
         DefineClass(
@@ -42,13 +105,18 @@ Napi::Object StreamListener::Init(Napi::Env env, Napi::Object exports){
     return exports;
 }
 
-class CloseFutureContext : public FutureContext
+// Queued behind outstanding writes, so close() can be called without waiting for them.
+class CloseFutureContext : public StreamWriteOperation
 {
 public:
-    CloseFutureContext(NabtoDevice* device, Napi::Env env, NabtoDeviceStream* stream) : FutureContext(device, env)
+    CloseFutureContext(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Stream* owner) : StreamWriteOperation(dispatcher, env, stream, owner)
     {
-        nabto_device_stream_close(stream, future_);
-        arm(false);
+    }
+
+    void start()
+    {
+        nabto_device_stream_close(stream_, future_);
+        setFutureCallback();
     }
 };
 
@@ -77,8 +145,10 @@ StreamListener::StreamListener(const Napi::CallbackInfo& info)
     NodeNabtoDevice* d = Napi::ObjectWrap<NodeNabtoDevice>::Unwrap(device.ToObject());
 
     device_ = d->getDevice();
+    dispatcher_ = d->getDispatcher();
 
-    listener_ = new StreamListenFutureContext(device_, env, port.ToNumber().Uint32Value());
+    listener_ = new StreamListenFutureContext(dispatcher_, env, port.ToNumber().Uint32Value());
+    port_ = listener_->getPort();
 }
 
 StreamListener::~StreamListener(){
@@ -86,22 +156,33 @@ StreamListener::~StreamListener(){
 }
 
 void StreamListener::Stop(const Napi::CallbackInfo& info){
-    listener_->stop();
+    if (listener_ != nullptr) {
+        listener_->stop();
+        listener_ = nullptr;
+    }
 }
 
 
 Napi::Value StreamListener::NotifyStream(const Napi::CallbackInfo& info){
+    if (listener_ == nullptr) {
+        Napi::Error::New(info.Env(), "Stream listener is stopped").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
     listener_->rearm();
     return listener_->Promise();
 }
 
 Napi::Value StreamListener::GetCurrentStream(const Napi::CallbackInfo& info){
-    return Napi::Number::New(info.Env(), (uint64_t)listener_->getStream());
+    if (listener_ == nullptr) {
+        Napi::Error::New(info.Env(), "Stream listener is stopped").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+    return handleValue(info.Env(), listener_->getStream());
 }
 
 Napi::Value StreamListener::GetStreamPort(const Napi::CallbackInfo& info)
 {
-    return Napi::Number::New(info.Env(), listener_->getPort());
+    return Napi::Number::New(info.Env(), port_);
 }
 
 /**************** STREAM IMPL ***************/
@@ -116,10 +197,16 @@ Napi::Object Stream::Init(Napi::Env env, Napi::Object exports){
                 InstanceMethod("getConnectionRef", &Stream::GetConnectionRef),
                 InstanceMethod("readSome", &Stream::ReadSome),
                 InstanceMethod("readAll", &Stream::ReadAll),
+                InstanceMethod("readInto", &Stream::ReadInto),
                 InstanceMethod("write", &Stream::Write),
+                InstanceMethod("writev", &Stream::Writev),
                 InstanceMethod("close", &Stream::Close),
                 InstanceMethod("abort", &Stream::Abort),
-                InstanceMethod("getData", &Stream::GetData),
+                InstanceMethod("setWriteWindow", &Stream::SetWriteWindow),
+                InstanceMethod("getWriteWindow", &Stream::GetWriteWindow),
+                InstanceMethod("startReading", &Stream::StartReading),
+                InstanceMethod("pauseReading", &Stream::PauseReading),
+                InstanceMethod("resumeReading", &Stream::ResumeReading),
             });
 
     Napi::FunctionReference* constructor = new Napi::FunctionReference();
@@ -148,23 +235,28 @@ Stream::Stream(const Napi::CallbackInfo& info)
         return;
     }
 
-    if (!stream.IsNumber()) {
-        Napi::TypeError::New(env, "Second arg expected stream reference").ThrowAsJavaScriptException();
+    NabtoDeviceStream* s = takeHandle<NabtoDeviceStream>(stream);
+    if (s == nullptr) {
+        Napi::TypeError::New(env, "Second arg expected unused stream reference").ThrowAsJavaScriptException();
         return;
     }
     NodeNabtoDevice* d = Napi::ObjectWrap<NodeNabtoDevice>::Unwrap(device.ToObject());
 
     device_ = d->getDevice();
-    stream_ = (NabtoDeviceStream*)stream.ToNumber().Int64Value();
+    dispatcher_ = d->getDispatcher();
+    stream_ = s;
 }
 
 Stream::~Stream(){
-    nabto_device_stream_free(stream_);
+    // Not set if the constructor threw.
+    if (stream_ != nullptr) {
+        nabto_device_stream_free(stream_);
+    }
 }
 
 
 Napi::Value Stream::Accept(const Napi::CallbackInfo& info){
-    AcceptFutureContext* afc = new AcceptFutureContext(device_, info.Env(), stream_);
+    AcceptFutureContext* afc = new AcceptFutureContext(dispatcher_, info.Env(), stream_, Value());
     return afc->Promise();
 
 }
@@ -172,65 +264,210 @@ Napi::Value Stream::Accept(const Napi::CallbackInfo& info){
 Napi::Value Stream::GetConnectionRef(const Napi::CallbackInfo& info){
     NabtoDeviceConnectionRef ref = nabto_device_stream_get_connection_ref(stream_);
 
-    return Napi::Number::New(info.Env(), (uint64_t)ref);
+    return connectionRefValue(info.Env(), ref);
 }
 
 Napi::Value Stream::ReadSome(const Napi::CallbackInfo& info){
-    this->reader_ = new ReadSomeFutureContext(device_, info.Env(), stream_);
-    return this->reader_->Promise();
+    Napi::Env env = info.Env();
+
+    size_t readLength = 1024;
+    if (info.Length() > 0 && !info[0].IsUndefined() && !sizeArg(env, info[0], "Max read length", 1, MAX_READ_LENGTH, &readLength)) {
+        return Napi::Value();
+    }
+    void* buffer = allocReadBuffer(env, readLength);
+    if (buffer == NULL) {
+        return Napi::Value();
+    }
+    ReadSomeFutureContext* rfc = new ReadSomeFutureContext(dispatcher_, env, stream_, Value(), buffer, readLength);
+    return rfc->Promise();
 }
 
 Napi::Value Stream::ReadAll(const Napi::CallbackInfo& info){
     Napi::Env env = info.Env();
 
-    int length = info.Length();
-    if (length < 1 || !info[0].IsNumber())
-    {
-        Napi::TypeError::New(env, "Expected read length").ThrowAsJavaScriptException();
+    size_t readLength;
+    if (!sizeArg(env, info[0], "Read length", 1, MAX_READ_LENGTH, &readLength)) {
         return Napi::Value();
     }
-    this->reader_ = new ReadAllFutureContext(device_, info.Env(), stream_, info[0].ToNumber().Uint32Value());
-    return this->reader_->Promise();
+    void* buffer = allocReadBuffer(env, readLength);
+    if (buffer == NULL) {
+        return Napi::Value();
+    }
+    ReadAllFutureContext* rfc = new ReadAllFutureContext(dispatcher_, env, stream_, Value(), buffer, readLength);
+    return rfc->Promise();
 
 }
 
-Napi::Value Stream::Write(const Napi::CallbackInfo& info){
+Napi::Value Stream::ReadInto(const Napi::CallbackInfo& info){
     Napi::Env env = info.Env();
 
     int length = info.Length();
-    if (length < 1 || !info[0].IsArrayBuffer())
+    if (length < 1 || !info[0].IsTypedArray() || info[0].As<Napi::TypedArray>().TypedArrayType() != napi_uint8_array)
     {
-        Napi::TypeError::New(env, "Expected arguments format: ArrayBuffer").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected arguments format: Uint8Array, offset?: Number, length?: Number").ThrowAsJavaScriptException();
         return Napi::Value();
     }
+    Napi::Uint8Array buf = info[0].As<Napi::Uint8Array>();
 
-    Napi::ArrayBuffer buf = info[0].As<Napi::ArrayBuffer>();
-    WriteFutureContext* wfc = new WriteFutureContext(device_, info.Env(), stream_, buf);
-    return wfc->Promise();
+    if (buf.ElementLength() == 0) {
+        Napi::RangeError::New(env, "The buffer is empty").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+    size_t offset = 0;
+    if (length > 1 && !info[1].IsUndefined() && !sizeArg(env, info[1], "Offset", 0, buf.ElementLength() - 1, &offset)) {
+        return Napi::Value();
+    }
 
+    // Up to the end of the buffer by default.
+    size_t readLength = buf.ElementLength() - offset;
+    if (length > 2 && !info[2].IsUndefined() && !sizeArg(env, info[2], "Length", 1, buf.ElementLength() - offset, &readLength)) {
+        return Napi::Value();
+    }
+
+    ReadIntoFutureContext* rfc = new ReadIntoFutureContext(dispatcher_, env, stream_, Value(), buf, offset, readLength);
+    return rfc->Promise();
+}
+
+void Stream::queueWriteOperation(StreamWriteOperation* op)
+{
+    bool idle;
+    {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        idle = writeQueue_.empty();
+        writeQueue_.push_back(op);
+    }
+    if (idle) {
+        op->start();
+    }
 }
 
-Napi::Value Stream::GetData(const Napi::CallbackInfo& info)
+Napi::Value Stream::startWrite(Napi::Env env, std::vector<StreamWriteChunk> chunks, std::vector<Napi::Object> owners)
 {
-    void* payload;
-    size_t length;
-    // TODO: handle reader_ not set and getBuffer returning false
-    this->reader_->getBuffer(&payload, &length);
-    Napi::ArrayBuffer buf = Napi::ArrayBuffer::New(info.Env(), payload, length);
-    this->reader_ = nullptr;
-    return buf;
+    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+    if (outstandingWriteOperations() >= writeWindow_) {
+        deferred.Reject(FutureContext::createError(env, NABTO_DEVICE_EC_OPERATION_IN_PROGRESS));
+        return deferred.Promise();
+    }
+    // Empty chunks are skipped, and a write of nothing resolves right away.
+    if (chunks.empty()) {
+        deferred.Resolve(env.Undefined());
+        return deferred.Promise();
+    }
+    WriteFutureContext* wfc = new WriteFutureContext(dispatcher_, env, stream_, this, std::move(chunks), std::move(owners));
+    queueWriteOperation(wfc);
+    return wfc->Promise();
+}
+
+Napi::Value Stream::Write(const Napi::CallbackInfo& info){
+    Napi::Env env = info.Env();
+
+    StreamWriteChunk chunk;
+    int length = info.Length();
+    if (length < 1 || !getByteRange(info[0], &chunk.data, &chunk.length))
+    {
+        Napi::TypeError::New(env, "Expected arguments format: ArrayBuffer or ArrayBuffer view").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+
+    std::vector<StreamWriteChunk> chunks;
+    std::vector<Napi::Object> owners;
+    if (chunk.length > 0) {
+        chunks.push_back(chunk);
+        owners.push_back(info[0].As<Napi::Object>());
+    }
+    return startWrite(env, std::move(chunks), std::move(owners));
 }
 
+Napi::Value Stream::Writev(const Napi::CallbackInfo& info){
+    Napi::Env env = info.Env();
+
+    int length = info.Length();
+    if (length < 1 || !info[0].IsArray())
+    {
+        Napi::TypeError::New(env, "Expected arguments format: Array of ArrayBuffer or ArrayBuffer view").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+
+    Napi::Array arr = info[0].As<Napi::Array>();
+    std::vector<StreamWriteChunk> chunks;
+    std::vector<Napi::Object> owners;
+    chunks.reserve(arr.Length());
+    owners.reserve(arr.Length());
+    for (uint32_t i = 0; i < arr.Length(); i++) {
+        Napi::Value v = arr.Get(i);
+        StreamWriteChunk chunk;
+        if (!getByteRange(v, &chunk.data, &chunk.length)) {
+            Napi::TypeError::New(env, "Expected arguments format: Array of ArrayBuffer or ArrayBuffer view").ThrowAsJavaScriptException();
+            return Napi::Value();
+        }
+        if (chunk.length > 0) {
+            chunks.push_back(chunk);
+            owners.push_back(v.As<Napi::Object>());
+        }
+    }
+    return startWrite(env, std::move(chunks), std::move(owners));
+}
 
 Napi::Value Stream::Close(const Napi::CallbackInfo& info){
-    CloseFutureContext* cfc = new CloseFutureContext(device_, info.Env(), stream_);
+    CloseFutureContext* cfc = new CloseFutureContext(dispatcher_, info.Env(), stream_, this);
+    queueWriteOperation(cfc);
     return cfc->Promise();
 
 }
 
+void Stream::SetWriteWindow(const Napi::CallbackInfo& info){
+    Napi::Env env = info.Env();
+
+    int length = info.Length();
+    if (length < 1 || !info[0].IsNumber() || info[0].ToNumber().Uint32Value() == 0)
+    {
+        Napi::TypeError::New(env, "Expected write window as a positive Number").ThrowAsJavaScriptException();
+        return;
+    }
+    writeWindow_ = info[0].ToNumber().Uint32Value();
+}
+
+Napi::Value Stream::GetWriteWindow(const Napi::CallbackInfo& info){
+    return Napi::Number::New(info.Env(), writeWindow_);
+}
+
 
 void Stream::Abort(const Napi::CallbackInfo& info){
     return nabto_device_stream_abort(stream_);
 }
 
+void Stream::StartReading(const Napi::CallbackInfo& info){
+    Napi::Env env = info.Env();
+
+    int length = info.Length();
+    if (length < 1 || !info[0].IsFunction())
+    {
+        Napi::TypeError::New(env, "Expected arguments format: callback: Function, bufferSize?: Number").ThrowAsJavaScriptException();
+        return;
+    }
+    size_t bufferSize = 64*1024;
+    if (length > 1 && !info[1].IsUndefined() && !sizeArg(env, info[1], "bufferSize", 1, MAX_READ_LENGTH, &bufferSize)) {
+        return;
+    }
+    if (pump_ != nullptr) {
+        Napi::Error::New(env, "Stream is already reading").ThrowAsJavaScriptException();
+        return;
+    }
+    uint8_t* ring = static_cast<uint8_t*>(allocReadBuffer(env, bufferSize));
+    if (ring == NULL) {
+        return;
+    }
+    pump_ = new StreamReadPump(dispatcher_, env, stream_, this, info[0].As<Napi::Function>(), ring, bufferSize);
+}
+
+void Stream::PauseReading(const Napi::CallbackInfo& info){
+    if (pump_ != nullptr) {
+        pump_->pause();
+    }
+}
 
+void Stream::ResumeReading(const Napi::CallbackInfo& info){
+    if (pump_ != nullptr) {
+        pump_->resume(info.Env());
+    }
+}
@@ -1,12 +1,20 @@
 #pragma once
 
 #include <napi.h>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <vector>
 #include "future.h"
 
+class StreamReadPump;
+class StreamWriteOperation;
+
 class StreamListenFutureContext : public FutureContext
 {
 public:
-    StreamListenFutureContext(NabtoDevice* device, Napi::Env env, uint32_t port) : FutureContext(device, env)
+    StreamListenFutureContext(FutureDispatcher* dispatcher, Napi::Env env, uint32_t port) : FutureContext(dispatcher, env)
     {
         lis_ = nabto_device_listener_new(device_);
         NabtoDeviceError ec;
@@ -25,6 +33,12 @@ public:
     ~StreamListenFutureContext() {
         nabto_device_listener_free(lis_);
     }
+
+    void cancel()
+    {
+        nabto_device_listener_stop(lis_);
+    }
+
     void rearm()
     {
         nabto_device_listener_new_stream(lis_, future_, &stream_);
@@ -48,12 +62,17 @@ private:
     uint32_t port_;
 };
 
+// The read contexts reference the JS stream object so the native stream is not
+// freed while a read is outstanding. They take over a read buffer allocated with
+// malloc() by the caller, which checks the allocation.
 class ReadFutureContext : public FutureContext
 {
 public:
-    ReadFutureContext(NabtoDevice* device, Napi::Env env, NabtoDeviceStream* stream) : FutureContext(device, env)
+    ReadFutureContext(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Napi::Object owner, void* buffer) : FutureContext(dispatcher, env)
     {
         stream_ = stream;
+        ownerRef_ = Napi::Persistent(owner);
+        readBuffer_ = buffer;
     }
 
     ~ReadFutureContext()
@@ -61,26 +80,27 @@ public:
         free(readBuffer_);
     }
 
-    bool getBuffer(void** buf, size_t* len)
+    // The promise resolves with an ArrayBuffer which takes over the read buffer.
+    Napi::Value resolveValue(Napi::Env env)
     {
-        *buf = readBuffer_;
-        *len = readLength_;
-        return true;
+        Napi::ArrayBuffer buf = Napi::ArrayBuffer::New(env, readBuffer_, readLength_, [](Napi::Env, void* data) { free(data); });
+        readBuffer_ = NULL;
+        return buf;
     }
 
 protected:
     NabtoDeviceStream* stream_;
-    void* readBuffer_;
-    size_t readLength_;
+    Napi::ObjectReference ownerRef_;
+    void* readBuffer_ = NULL;
+    size_t readLength_ = 0;
 };
 
 class ReadSomeFutureContext : public ReadFutureContext
 {
 public:
-    ReadSomeFutureContext(NabtoDevice* device, Napi::Env env, NabtoDeviceStream* stream) : ReadFutureContext(device, env, stream)
+    ReadSomeFutureContext(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Napi::Object owner, void* buffer, size_t length) : ReadFutureContext(dispatcher, env, stream, owner, buffer)
     {
-        readBuffer_ = calloc(1, 1024);
-        nabto_device_stream_read_some(stream, future_, (void*)readBuffer_, 1024, &readLength_);
+        nabto_device_stream_read_some(stream, future_, (void*)readBuffer_, length, &readLength_);
         arm(false);
     }
 };
@@ -88,15 +108,46 @@ public:
 class ReadAllFutureContext : public ReadFutureContext
 {
 public:
-    ReadAllFutureContext(NabtoDevice* device, Napi::Env env, NabtoDeviceStream* stream, size_t length) : ReadFutureContext(device, env, stream)
+    ReadAllFutureContext(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Napi::Object owner, void* buffer, size_t length) : ReadFutureContext(dispatcher, env, stream, owner, buffer)
     {
-        readBuffer_ = calloc(1, length);
         nabto_device_stream_read_all(stream, future_, (void*)readBuffer_, length, &readLength_);
         arm(false);
     }
 };
 
+// Reads directly into the backing store of a caller supplied Uint8Array. The
+// array and the JS stream object are referenced until the read resolves so
+// neither can be collected while the SDK writes into the array. The promise
+// resolves with the number of bytes read.
+class ReadIntoFutureContext : public FutureContext
+{
+public:
+    ReadIntoFutureContext(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Napi::Object owner, Napi::Uint8Array buffer, size_t offset, size_t length) : FutureContext(dispatcher, env)
+    {
+        ownerRef_ = Napi::Persistent(owner);
+        buffer_ = Napi::Persistent(buffer.As<Napi::Object>());
+        nabto_device_stream_read_some(stream, future_, buffer.Data() + offset, length, &readLength_);
+        arm(false);
+    }
 
+    Napi::Value resolveValue(Napi::Env env)
+    {
+        return Napi::Number::New(env, readLength_);
+    }
+
+private:
+    Napi::ObjectReference ownerRef_;
+    Napi::ObjectReference buffer_;
+    size_t readLength_ = 0;
+};
+
+
+
+// Bytes of a buffer passed to write(), written without copying.
+struct StreamWriteChunk {
+    uint8_t* data;
+    size_t length;
+};
 
 class StreamListener : public Napi::ObjectWrap<StreamListener>
 {
@@ -112,6 +163,7 @@ public:
 
 private:
     NabtoDevice* device_;
+    FutureDispatcher* dispatcher_;
     StreamListenFutureContext* listener_;
     uint32_t port_;
 };
@@ -127,15 +179,271 @@ public:
     Napi::Value GetConnectionRef(const Napi::CallbackInfo& info);
     Napi::Value ReadSome(const Napi::CallbackInfo& info);
     Napi::Value ReadAll(const Napi::CallbackInfo& info);
+    Napi::Value ReadInto(const Napi::CallbackInfo& info);
     Napi::Value Write(const Napi::CallbackInfo& info);
+    Napi::Value Writev(const Napi::CallbackInfo& info);
     Napi::Value Close(const Napi::CallbackInfo& info);
 
     void Abort(const Napi::CallbackInfo& info);
-    Napi::Value GetData(const Napi::CallbackInfo& info);
 
+    void StartReading(const Napi::CallbackInfo& info);
+    void PauseReading(const Napi::CallbackInfo& info);
+    void ResumeReading(const Napi::CallbackInfo& info);
+
+    void SetWriteWindow(const Napi::CallbackInfo& info);
+    Napi::Value GetWriteWindow(const Napi::CallbackInfo& info);
+
+    void pumpFinished()
+    {
+        pump_ = nullptr;
+    }
+
+    Napi::Value startWrite(Napi::Env env, std::vector<StreamWriteChunk> chunks, std::vector<Napi::Object> owners);
+
+    // Queues a write side operation and starts it if none is in progress.
+    void queueWriteOperation(StreamWriteOperation* op);
+
+    // Called on the SDK thread when the operation in progress completes.
+    // Returns the next operation to start, if any.
+    StreamWriteOperation* writeOperationDone()
+    {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        writeQueue_.pop_front();
+        return writeQueue_.empty() ? nullptr : writeQueue_.front();
+    }
+
+    size_t outstandingWriteOperations()
+    {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        return writeQueue_.size();
+    }
+
+    static const size_t DEFAULT_WRITE_WINDOW = 16;
+    // Upper bound on a read length and on the read pump buffer size, so a bad
+    // argument cannot make a single call allocate gigabytes.
+    static const size_t MAX_READ_LENGTH = 16 * 1024 * 1024;
 
 private:
     NabtoDevice* device_;
+    FutureDispatcher* dispatcher_;
+    NabtoDeviceStream* stream_ = nullptr;
+    StreamReadPump* pump_ = nullptr;
+
+    std::mutex writeMutex_;
+    // The first operation is the one in progress.
+    std::deque<StreamWriteOperation*> writeQueue_;
+    size_t writeWindow_ = DEFAULT_WRITE_WINDOW;
+};
+
+// A write or close on a Stream. The SDK allows only one of these in progress
+// per stream, so the Stream queues them and the next one is started from the
+// SDK thread as soon as the previous one completes, without waiting for the JS
+// thread. The operation references the JS stream object so the native stream
+// is not freed while it is queued.
+class StreamWriteOperation : public FutureContext
+{
+public:
+    StreamWriteOperation(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Stream* owner)
+    : FutureContext(dispatcher, env), stream_(stream), owner_(owner)
+    {
+        ownerRef_ = Napi::Persistent(owner->Value());
+        // Waiting from the moment it is queued.
+        setActive(true);
+    }
+
+    // Submits the operation to the SDK. Runs on the JS thread for an operation
+    // queued on an idle stream, and on the SDK thread otherwise.
+    virtual void start() = 0;
+
+    void resolved(NabtoDeviceError ec)
+    {
+        // The operation may be deleted as soon as it is posted, so the next one
+        // must be taken from the queue first.
+        StreamWriteOperation* next = owner_->writeOperationDone();
+        FutureContext::resolved(ec);
+        if (next != nullptr) {
+            next->start();
+        }
+    }
+
+protected:
+    NabtoDeviceStream* stream_;
+
+private:
+    Stream* owner_;
+    Napi::ObjectReference ownerRef_;
+};
+
+// Flowing mode reader. Keeps nabto_device_stream_read_some armed back to back
+// into a ring buffer from the SDK thread, and delivers everything read since the
+// last delivery as a single Buffer per JS callback. While the JS side is behind,
+// completed reads only append to the ring, so a burst of small reads costs one
+// callback. Reading stops while the ring is full and resumes once it is drained.
+//
+// The callback is called as callback(data) for data and once as
+// callback(undefined, error) when the stream ends, error.code being
+// NABTO_DEVICE_EC_EOF for a clean end of stream.
+class StreamReadPump : public FutureContext
+{
+public:
+    // Takes over the ring, allocated with malloc() by the caller.
+    StreamReadPump(FutureDispatcher* dispatcher, Napi::Env env, NabtoDeviceStream* stream, Stream* owner, Napi::Function callback, uint8_t* ring, size_t capacity)
+    : FutureContext(dispatcher, env), stream_(stream), owner_(owner), ring_(ring), capacity_(capacity)
+    {
+        // The pump keeps the JS stream object alive so the native stream is not freed while reading.
+        ownerRef_ = Napi::Persistent(owner->Value());
+        callback_ = Napi::Persistent(callback);
+        repeatable_ = true;
+        endEc_ = NABTO_DEVICE_EC_OK;
+        setActive(true);
+        readNext();
+    }
+
+    ~StreamReadPump()
+    {
+        free(ring_);
+    }
+
+    bool done()
+    {
+        return finished_;
+    }
+
+    void pause()
+    {
+        paused_ = true;
+    }
+
+    // Must not be called after the pump has finished.
+    void resume(Napi::Env env)
+    {
+        paused_ = false;
+        if (delivering_) {
+            // Resumed from within the callback, the running delivery continues.
+            return;
+        }
+        deliver(env);
+        if (finished_) {
+            delete this;
+        }
+    }
+
+    void resolved(NabtoDeviceError ec)
+    {
+        bool notify;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reading_ = false;
+            if (ec == NABTO_DEVICE_EC_OK) {
+                used_ += readLength_;
+            } else {
+                endEc_ = ec;
+            }
+            notify = !notifyPending_;
+            notifyPending_ = true;
+        }
+        readNext();
+        if (notify) {
+            dispatcher_->post(this);
+        }
+    }
+
+    void complete(Napi::Env env)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            notifyPending_ = false;
+        }
+        deliver(env);
+    }
+
+private:
+    void readNext()
+    {
+        uint8_t* target;
+        size_t length;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (reading_ || endEc_ != NABTO_DEVICE_EC_OK || used_ == capacity_) {
+                return;
+            }
+            if (used_ == 0) {
+                head_ = 0;
+            }
+            size_t tail = (head_ + used_) % capacity_;
+            length = tail < head_ ? head_ - tail : capacity_ - tail;
+            target = ring_ + tail;
+            reading_ = true;
+        }
+        // The future may resolve synchronously, so the lock must not be held here.
+        nabto_device_stream_read_some(stream_, future_, target, length, &readLength_);
+        setFutureCallback();
+    }
+
+    void deliver(Napi::Env env)
+    {
+        if (paused_ || finished_) {
+            return;
+        }
+        Napi::Value data = drain(env);
+        if (!data.IsUndefined()) {
+            delivering_ = true;
+            callback_.Call({data});
+            delivering_ = false;
+        }
+        // Re-arm in case reading stopped on a full ring.
+        readNext();
+        if (paused_) {
+            return;
+        }
+
+        NabtoDeviceError endEc;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // A queued notification will finish the pump when it is dispatched.
+            if (endEc_ == NABTO_DEVICE_EC_OK || used_ > 0 || reading_ || notifyPending_) {
+                return;
+            }
+            endEc = endEc_;
+        }
+        finished_ = true;
+        setActive(false);
+        owner_->pumpFinished();
+        callback_.Call({env.Undefined(), createError(env, endEc)});
+    }
+
+    Napi::Value drain(Napi::Env env)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (used_ == 0) {
+            return env.Undefined();
+        }
+        Napi::Buffer<uint8_t> data = Napi::Buffer<uint8_t>::New(env, used_);
+        size_t first = std::min(used_, capacity_ - head_);
+        memcpy(data.Data(), ring_ + head_, first);
+        memcpy(data.Data() + first, ring_, used_ - first);
+        head_ = (head_ + used_) % capacity_;
+        used_ = 0;
+        return data;
+    }
+
     NabtoDeviceStream* stream_;
-    ReadFutureContext* reader_;
+    Stream* owner_;
+    Napi::ObjectReference ownerRef_;
+    Napi::FunctionReference callback_;
+
+    std::mutex mutex_;
+    uint8_t* ring_;
+    size_t capacity_;
+    size_t head_ = 0;
+    size_t used_ = 0;
+    size_t readLength_ = 0;
+    bool reading_ = false;
+    bool notifyPending_ = false;
+    NabtoDeviceError endEc_;
+
+    // Only touched on the JS thread.
+    bool paused_ = false;
+    bool finished_ = false;
+    bool delivering_ = false;
 };
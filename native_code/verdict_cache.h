@@ -0,0 +1,256 @@
+#pragma once
+
+#include <napi.h>
+#include <nabto/nabto_device.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "future.h"
+#include "constants.h"
+
+// Authorization verdicts by connection and request, so repeats of a request on
+// the same connection are answered on the SDK thread without evaluating the
+// policy or asking JS again. Entries expire after the TTL. The entries of a
+// connection are removed when it closes, when it becomes password authenticated
+// and by invalidate(), and everything is removed when the policy changes or by
+// clear(). Verdicts looked up before a clear() and given after it are not
+// cached, see generation().
+//
+// Used from both SDK threads and the JS thread.
+class VerdictCache
+{
+public:
+    static const size_t DEFAULT_MAX_ENTRIES = 10000;
+
+    VerdictCache(std::chrono::milliseconds ttl, size_t maxEntries) : ttl_(ttl), maxEntries_(maxEntries)
+    {
+    }
+
+    // The action followed by the attribute names and values.
+    static std::string key(NabtoDeviceAuthorizationRequest* req)
+    {
+        std::string key = nabto_device_authorization_request_get_action(req);
+        size_t size = nabto_device_authorization_request_get_attributes_size(req);
+        for (size_t i = 0; i < size; i++) {
+            key.push_back('\0');
+            key.append(nabto_device_authorization_request_get_attribute_name(req, i));
+            key.push_back('\0');
+            key.append(nabto_device_authorization_request_get_attribute_value(req, i));
+        }
+        return key;
+    }
+
+    uint64_t generation()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return generation_;
+    }
+
+    // passwordAuthenticated is the current state of the connection, the
+    // entries of a connection are dropped if it differs from when they were
+    // cached, as the verdicts may depend on it.
+    bool lookup(NabtoDeviceConnectionRef ref, bool passwordAuthenticated, const std::string& key, bool* allowed)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto conn = connections_.find(ref);
+        if (conn != connections_.end()) {
+            if (conn->second.passwordAuthenticated != passwordAuthenticated) {
+                eraseLocked(conn);
+            } else {
+                auto it = conn->second.entries.find(key);
+                if (it != conn->second.entries.end()) {
+                    if (it->second.expires > std::chrono::steady_clock::now()) {
+                        hits_++;
+                        *allowed = it->second.allowed;
+                        return true;
+                    }
+                    conn->second.entries.erase(it);
+                    size_--;
+                }
+            }
+        }
+        misses_++;
+        return false;
+    }
+
+    // generation is the generation() and passwordAuthenticated the state of
+    // the connection from before the verdict was decided.
+    void insert(NabtoDeviceConnectionRef ref, bool passwordAuthenticated, const std::string& key, bool allowed, uint64_t generation)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (generation != generation_) {
+            return;
+        }
+        if (size_ >= maxEntries_) {
+            evictExpired();
+            if (size_ >= maxEntries_) {
+                connections_.clear();
+                size_ = 0;
+            }
+        }
+        auto conn = connections_.find(ref);
+        if (conn != connections_.end() && conn->second.passwordAuthenticated != passwordAuthenticated) {
+            eraseLocked(conn);
+            conn = connections_.end();
+        }
+        if (conn == connections_.end()) {
+            conn = connections_.emplace(ref, Connection()).first;
+            conn->second.passwordAuthenticated = passwordAuthenticated;
+        }
+        Entry& entry = conn->second.entries[key];
+        if (entry.expires == std::chrono::steady_clock::time_point()) {
+            size_++;
+        }
+        entry.allowed = allowed;
+        entry.expires = std::chrono::steady_clock::now() + ttl_;
+    }
+
+    // Removes the entries of a closed connection.
+    void remove(NabtoDeviceConnectionRef ref)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto conn = connections_.find(ref);
+        if (conn != connections_.end()) {
+            eraseLocked(conn);
+        }
+    }
+
+    // Removes the entries of a connection whose state the verdicts depend on
+    // has changed. Verdicts decided before this are not cached.
+    void invalidate(NabtoDeviceConnectionRef ref)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto conn = connections_.find(ref);
+        if (conn != connections_.end()) {
+            eraseLocked(conn);
+        }
+        generation_++;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connections_.clear();
+        size_ = 0;
+        generation_++;
+    }
+
+    // Returns { hits, misses, entries }.
+    Napi::Object stats(Napi::Env env)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Napi::Object stats = Napi::Object::New(env);
+        stats.Set("hits", Napi::Number::New(env, hits_));
+        stats.Set("misses", Napi::Number::New(env, misses_));
+        stats.Set("entries", Napi::Number::New(env, size_));
+        return stats;
+    }
+
+private:
+    struct Entry {
+        bool allowed = false;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    struct Connection {
+        bool passwordAuthenticated = false;
+        std::unordered_map<std::string, Entry> entries;
+    };
+
+    typedef std::unordered_map<NabtoDeviceConnectionRef, Connection>::iterator ConnectionIterator;
+
+    void eraseLocked(ConnectionIterator conn)
+    {
+        size_ -= conn->second.entries.size();
+        connections_.erase(conn);
+    }
+
+    void evictExpired()
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (auto conn = connections_.begin(); conn != connections_.end();) {
+            auto& entries = conn->second.entries;
+            for (auto it = entries.begin(); it != entries.end();) {
+                if (it->second.expires <= now) {
+                    it = entries.erase(it);
+                    size_--;
+                } else {
+                    it++;
+                }
+            }
+            if (entries.empty()) {
+                conn = connections_.erase(conn);
+            } else {
+                conn++;
+            }
+        }
+    }
+
+    std::chrono::milliseconds ttl_;
+    size_t maxEntries_;
+    std::mutex mutex_;
+    std::unordered_map<NabtoDeviceConnectionRef, Connection> connections_;
+    size_t size_ = 0;
+    uint64_t generation_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+// Removes the entries of closed connections from a VerdictCache. The connection
+// events are handled on the SDK thread, JS is only involved when the listener
+// stops. Does not keep the event loop alive.
+class VerdictCacheEvictor : public FutureContext
+{
+public:
+    VerdictCacheEvictor(FutureDispatcher* dispatcher, Napi::Env env, std::shared_ptr<VerdictCache> cache)
+      : FutureContext(dispatcher, env), cache_(cache)
+    {
+        background_ = true;
+        repeatable_ = true;
+        lis_ = nabto_device_listener_new(device_);
+        if (nabto_device_connection_events_init_listener(device_, lis_) == NABTO_DEVICE_EC_OK) {
+            nabto_device_listener_connection_event(lis_, future_, &ref_, &event_);
+            setActive(true);
+            setFutureCallback();
+        }
+    }
+
+    ~VerdictCacheEvictor()
+    {
+        nabto_device_listener_free(lis_);
+    }
+
+    void cancel()
+    {
+        nabto_device_listener_stop(lis_);
+    }
+
+    void resolved(NabtoDeviceError ec)
+    {
+        if (ec != NABTO_DEVICE_EC_OK) {
+            FutureContext::resolved(ec);
+            return;
+        }
+        if (connectionEventCode(event_) == CONNECTION_EVENT_CLOSED) {
+            cache_->remove(ref_);
+        }
+        nabto_device_listener_connection_event(lis_, future_, &ref_, &event_);
+        setFutureCallback();
+    }
+
+    // Nothing waits for the promise.
+    void complete(Napi::Env env)
+    {
+        setActive(false);
+    }
+
+private:
+    std::shared_ptr<VerdictCache> cache_;
+    NabtoDeviceListener* lis_;
+    NabtoDeviceConnectionEvent event_;
+    NabtoDeviceConnectionRef ref_;
+};
@@ -1,4 +1,6 @@
+import { Duplex, DuplexOptions } from "stream";
 import { NabtoDeviceImpl } from "./impl/NabtoDeviceImpl";
+export { forEachLogRecord } from "./impl/LogRecords";
 
 
 export interface DeviceOptions {
@@ -20,6 +22,47 @@ export interface LogMessage {
   severity: string
 }
 
+// Numeric severities used in binary log records.
+export enum LogSeverity {
+  FATAL = 0x01,
+  ERROR = 0x02,
+  WARN = 0x04,
+  INFO = 0x08,
+  TRACE = 0x10
+}
+
+// A decoded binary log record, see forEachLogRecord.
+export interface LogRecord {
+  // Milliseconds since the epoch.
+  time: number,
+  severity: LogSeverity,
+  // Name of the directory containing the source file.
+  module: string,
+  file: string,
+  line: number,
+  message: string
+}
+
+// Called with a run of binary log records in ring[offset, offset + length). The
+// ring is reused once the callback returns. Records are packed little endian as
+// u32 record length, u32 severity, f64 time, u32 line, u16 module length,
+// u16 file length, u32 message length, followed by the module, file and message bytes.
+export type LogRecordCallback = (ring: ArrayBuffer, offset: number, length: number) => void;
+
+// Log lines are written by the SDK thread which logs them, without involving JS.
+export interface LogSinkOptions {
+  // Write to an open file descriptor, which is not closed by the device.
+  fd?: number,
+  // Append to a file, rotated to path.1, path.2, ... when it would grow past maxSize bytes.
+  path?: string,
+  // "text" (default) or "json" with one object per line.
+  format?: "text" | "json",
+  // 0 (default) never rotates.
+  maxSize?: number,
+  // Number of rotated files kept, 5 by default.
+  maxFiles?: number
+}
+
 export interface DeviceConfiguration {
   productId: string;
   deviceId: string;
@@ -30,29 +73,32 @@ export interface DeviceConfiguration {
   deviceFingerprint: string;
 }
 
+// The values of these enums are the codes used by the native binding.
 export enum ConnectionEvent {
-  OPENED = "NABTO_DEVICE_CONNECTION_EVENT_OPENED",
-  CLOSED = "NABTO_DEVICE_CONNECTION_EVENT_CLOSED",
-  CHANNEL_CHANGED = "NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED",
+  OPENED = 0,
+  CLOSED = 1,
+  CHANNEL_CHANGED = 2,
 }
 
 export enum DeviceEvent {
-  ATTACHED = "NABTO_DEVICE_EVENT_ATTACHED",
-  DETACHED = "NABTO_DEVICE_EVENT_DETACHED",
-  CLOSED = "NABTO_DEVICE_EVENT_CLOSED",
-  UNKNOWN_FINGERPRINT = "NABTO_DEVICE_EVENT_UNKNOWN_FINGERPRINT",
-  WRONG_PRODUCT_ID = "NABTO_DEVICE_EVENT_WRONG_PRODUCT_ID",
-  WRONG_DEVICE_ID = "NABTO_DEVICE_EVENT_WRONG_DEVICE_ID",
+  ATTACHED = 0,
+  DETACHED = 1,
+  CLOSED = 2,
+  UNKNOWN_FINGERPRINT = 3,
+  WRONG_PRODUCT_ID = 4,
+  WRONG_DEVICE_ID = 5,
 }
 
 export enum CoapMethod {
-  GET = "NABTO_DEVICE_COAP_GET",
-  POST = "NABTO_DEVICE_COAP_POST",
-  PUT = "NABTO_DEVICE_COAP_PUT",
-  DELETE = "NABTO_DEVICE_COAP_DELETE",
+  GET = 0,
+  POST = 1,
+  PUT = 2,
+  DELETE = 3,
 }
 
-export type ConnectionRef = any;
+// Opaque 64 bit reference to a connection. Refs are BigInts, so refs to the same
+// connection from different sources compare equal with ===.
+export type ConnectionRef = bigint;
 
 export type ConnectionEventCallback = (ev: ConnectionEvent, connectionRef: ConnectionRef) => void;
 
@@ -60,30 +106,104 @@ export type DeviceEventCallback = (ev: DeviceEvent) => void;
 
 export interface CoapRequest {
   getFormat(): Number;
+  // A view of the request payload, valid until the response is sent. Copy the data to keep it longer.
   getPayload(): ArrayBuffer;
   getConnectionRef(): ConnectionRef;
   getParameter(parameterName: string): string;
   sendErrorResponse(code: Number, message: string): void;
   setResponseCode(code: Number): void;
-  setResponsePayload(format: Number, payload: ArrayBuffer): void;
+  setResponsePayload(format: Number, payload: ArrayBuffer | ArrayBufferView): void;
   responseReady(): void;
+  // Sets the code and the optional payload and sends the response in one call.
+  respond(code: number, format?: number, payload?: ArrayBuffer | ArrayBufferView): void;
 }
 
 export type CoapRequestCallback = (req: CoapRequest) => void;
 
+// Summary of a latency histogram. Values are in microseconds, percentiles are accurate to about 6%.
+export interface LatencyStats {
+  count: number;
+  min: number;
+  max: number;
+  mean: number;
+  p50: number;
+  p90: number;
+  p99: number;
+  p999: number;
+}
+
+export interface CoapEndpointStats {
+  method: CoapMethod;
+  path: string;
+  // From the request being taken from the listener until the handler is called.
+  queueWait: LatencyStats;
+  // From the handler being called until the response is sent.
+  handler: LatencyStats;
+  total: LatencyStats;
+}
+
+export interface StreamReadOptions {
+  // Max bytes returned by a single readSome(). Default 1024.
+  readChunkSize?: number;
+  // Grow the chunk size when reads come back full and shrink it when they come back short.
+  adaptiveReadSize?: boolean;
+  // Bounds for the adaptive chunk size. Defaults 1024 and 262144.
+  minReadChunkSize?: number;
+  maxReadChunkSize?: number;
+}
+
 export interface Stream {
   accept(): Promise<void>;
   getConnectionRef(): ConnectionRef;
   readSome(): Promise<ArrayBuffer>;
+  // Read lengths and the startReading() bufferSize are at most 16 MiB, larger values throw a RangeError.
   readAll(length: number): Promise<ArrayBuffer>;
-  write(data: ArrayBuffer): Promise<void>;
+  // Read some bytes directly into buf starting at offset. Resolves with the number of bytes read.
+  readInto(buf: Uint8Array, offset?: number, length?: number): Promise<number>;
+  // Writes the bytes of the buffer or view in place, without copying it first.
+  write(data: ArrayBuffer | ArrayBufferView): Promise<void>;
+  // Writes all chunks in order as one operation which resolves once everything is written.
+  writev(chunks: (ArrayBuffer | ArrayBufferView)[]): Promise<void>;
+  // Writes may be pipelined without awaiting each one. They are written in call order and up
+  // to getWriteWindow() writes (default 16) can be outstanding, further writes reject with
+  // code NABTO_DEVICE_EC_OPERATION_IN_PROGRESS. The buffers must not be modified until their
+  // write resolves.
+  setWriteWindow(window: number): void;
+  getWriteWindow(): number;
+  // Closes the stream for writing once all outstanding writes are done.
   close(): Promise<void>;
   abort(): void;
+  setReadOptions(opts: StreamReadOptions): void;
+  // The max length the next readSome() will request.
+  getReadChunkSize(): number;
+  // Wrap the stream in a Node.js Duplex for use with pipe() and pipeline().
+  // Do not mix with direct reads and writes on the same stream. Chunks may be reused once
+  // their write callback is called: writes acknowledged before the data is sent, to keep
+  // the write window full, are copied first, the others are sent in place.
+  createDuplex(opts?: DuplexOptions): Duplex;
+  // Flowing mode: a native reader keeps reading into a ring buffer of bufferSize bytes
+  // (default 65536) and onData gets everything received since the previous call as one Buffer.
+  // onEnd is called once, without an error at end of stream. Do not mix with readSome/readAll/readInto.
+  startReading(onData: (data: Buffer) => void, onEnd: (err?: Error) => void, bufferSize?: number): void;
+  // While paused, data is kept in the ring buffer and reading stops when it is full.
+  pauseReading(): void;
+  resumeReading(): void;
 }
 
 export type StreamCallback = (stream: Stream) => void;
 
+export interface ConnectionInfo {
+  clientFingerprint: string;
+  isLocal: boolean;
+  isPasswordAuthenticated: boolean;
+  // Only set once the connection is password authenticated.
+  passwordAuthenticationUsername?: string;
+}
+
+// Connection metadata is cached natively while the connection is open.
 export interface Connection {
+  // All of the metadata of a connection in one call.
+  getInfo(connectionRef: ConnectionRef): ConnectionInfo;
   getClientFingerprint(connectionRef: ConnectionRef): string;
   isLocal(connectionRef: ConnectionRef): Boolean;
   isPasswordAuthenticated(connectionRef: ConnectionRef): Boolean;
@@ -94,11 +214,62 @@ export interface AuthorizationRequest {
   verdict(allowed: Boolean): void;
   getAction(): string;
   getConnectionRef(): ConnectionRef;
+  // Converts every attribute, prefer getAttribute() or attributes() when only some are needed.
   getAttributes(): {[key: string]: string};
+  // The value of an attribute, or undefined if the request does not have it.
+  getAttribute(name: string): string | undefined;
+  // [name, value] pairs read from the request one at a time as the iterator advances.
+  attributes(): IterableIterator<[string, string]>;
 }
 
 export type AuthorizationRequestCallback = (req: AuthorizationRequest) => void;
 
+export interface AuthorizationPolicyStatement {
+  effect: "Allow" | "Deny";
+  // Actions ending in * match every action starting with the rest, e.g. "TcpTunnel:*".
+  actions: string[];
+  // All conditions must hold for the statement to apply. A key is a request attribute
+  // or one of Connection:Fingerprint, Connection:IsLocal, Connection:IsPasswordAuthenticated
+  // and Connection:Username. A value is a string, or a variable like "${Connection:Username}",
+  // and a list of values matches any of them.
+  conditions?: {
+    stringEquals?: { [key: string]: string | string[] },
+    stringNotEquals?: { [key: string]: string | string[] }
+  }[];
+}
+
+// Evaluated natively for each authorization request. A request is denied if a statement of
+// the role of the connection denies it, else allowed if one allows it. Requests the policy
+// does not decide, or from connections without a role, go to onAuthorizationRequest.
+export interface AuthorizationPolicy {
+  policies: { id: string, statements: AuthorizationPolicyStatement[] }[];
+  roles: { id: string, policies: string[] }[];
+  // Role ids by client fingerprint.
+  fingerprints?: { [fingerprint: string]: string };
+  // Role of connections whose fingerprint is not in fingerprints.
+  defaultRole?: string;
+}
+
+export interface AuthorizationCacheOptions {
+  // Milliseconds a verdict is reused, 10000 by default.
+  ttl?: number;
+  // 10000 by default. Expired entries are evicted when the cache is full, then everything.
+  maxEntries?: number;
+}
+
+export interface AuthorizationCacheStats {
+  hits: number;
+  misses: number;
+  entries: number;
+}
+
+export interface AuthorizationPolicyStats {
+  allowed: number;
+  denied: number;
+  // Requests passed on to onAuthorizationRequest, or denied if there is no callback.
+  unmatched: number;
+}
+
 export interface IceServer {
   username: string;
   credential: string;
@@ -121,26 +292,54 @@ export interface NabtoDevice {
   setOptions(opts: DeviceOptions): void;
   createPrivateKey(): string;
   setLogLevel(logLevel: string): void;
+  // Only lines at or above the level set with setLogLevel are passed on to the callback.
   setLogCallback(callback: (logMessage: LogMessage) => void): void;
+  // Log lines dropped because the callback did not keep up with the SDK.
+  getDroppedLogMessages(): number;
+  // Writes log lines to a file in addition to the log callback, or removes the sink when called without options.
+  setLogSink(opts?: LogSinkOptions): void;
+  // Delivers log lines as binary records in a ring buffer of capacity bytes (1 MiB by default),
+  // in addition to the log callback and sink. Returns the ring.
+  setLogRecordCallback(callback: LogRecordCallback, capacity?: number): ArrayBuffer;
   getConfiguration() : DeviceConfiguration;
   setBasestationAttach(enable: Boolean): void;
 
   onConnectionEvent(fn: ConnectionEventCallback): void;
   onDeviceEvent(fn: DeviceEventCallback): void;
   onAuthorizationRequest(fn: AuthorizationRequestCallback): void;
+  // Answers authorization requests natively from a policy, or its JSON. Without a policy
+  // every request goes to onAuthorizationRequest, which is also the case when called without one.
+  setAuthorizationPolicy(policy?: AuthorizationPolicy | string): void;
+  getAuthorizationPolicyStats(): AuthorizationPolicyStats;
+  // Caches verdicts by connection, action and attributes, so repeated requests are answered
+  // natively without the policy or onAuthorizationRequest. Entries of a connection are removed
+  // when it closes or becomes password authenticated, and all entries when the policy changes.
+  // Called without options the cache is disabled.
+  setAuthorizationCache(opts?: AuthorizationCacheOptions): void;
+  // Call when state onAuthorizationRequest decides on changes, e.g. when a connection is paired.
+  // Drops the cached verdicts of the connection, or of all connections without a ref.
+  clearAuthorizationCache(connectionRef?: ConnectionRef): void;
+  // Undefined while the cache is disabled.
+  getAuthorizationCacheStats(): AuthorizationCacheStats | undefined;
 
   mdnsAddSubtype(type: string): void;
   mdnsAddTxtItem(key: string, value: string): void;
   createServerConnectToken(): string;
   addServerConnectToken(sct: string): void;
   areServerConnectTokensSync(): Boolean;
+  // CoAP and authorization requests handed to callbacks which are not freed yet. Requests are
+  // freed when the response or verdict is sent, or when an unanswered request is garbage collected.
+  getLiveRequestCounts(): { coap: number, authorization: number };
+  // Latency per CoAP endpoint, optionally resetting the histograms after reading them.
+  getCoapEndpointStats(reset?: boolean): CoapEndpointStats[];
 
   addCoapEndpoint(method: CoapMethod, path: string, cb: CoapRequestCallback): void;
 
   // Setting the port = 0, the device uses an ephemeral port number.
   // if port = 0: this returns the chosen ephemeral port
   // if port != 0: this returns the provided port
-  addStream(port: number, cb: StreamCallback): number;
+  // opts are the default read options of streams accepted on the port.
+  addStream(port: number, cb: StreamCallback, opts?: StreamReadOptions): number;
 
   addTcpTunnelService(serviceId: string, serviceType: string, host: string, port: number): void;
   removeTcpTunnelService(serviceId: string): void;
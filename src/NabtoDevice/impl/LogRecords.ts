@@ -0,0 +1,27 @@
+import { LogRecord } from "../NabtoDevice";
+
+const HEADER_SIZE = 28;
+const decoder = new TextDecoder();
+
+// Decodes the binary log records in ring[offset, offset + length), see setLogRecordCallback.
+export function forEachLogRecord(ring: ArrayBuffer, offset: number, length: number, fn: (record: LogRecord) => void) {
+  let view = new DataView(ring, offset, length);
+  let bytes = new Uint8Array(ring, offset, length);
+  let pos = 0;
+  while (pos + HEADER_SIZE <= length) {
+    let recordLength = view.getUint32(pos, true);
+    let moduleLength = view.getUint16(pos + 20, true);
+    let fileLength = view.getUint16(pos + 22, true);
+    let messageLength = view.getUint32(pos + 24, true);
+    let start = pos + HEADER_SIZE;
+    fn({
+      severity: view.getUint32(pos + 4, true),
+      time: view.getFloat64(pos + 8, true),
+      line: view.getUint32(pos + 16, true),
+      module: decoder.decode(bytes.subarray(start, start + moduleLength)),
+      file: decoder.decode(bytes.subarray(start + moduleLength, start + moduleLength + fileLength)),
+      message: decoder.decode(bytes.subarray(start + moduleLength + fileLength, start + moduleLength + fileLength + messageLength)),
+    });
+    pos += recordLength;
+  }
+}
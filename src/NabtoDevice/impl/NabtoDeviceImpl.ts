@@ -1,7 +1,23 @@
-import { NabtoDevice, DeviceConfiguration, DeviceOptions, LogMessage, ConnectionEvent, ConnectionEventCallback, DeviceEventCallback, DeviceEvent, ConnectionRef, Connection, CoapMethod, CoapRequestCallback, CoapRequest, AuthorizationRequestCallback, AuthorizationRequest, Experimental, IceServersRequest, IceServer, StreamCallback, Stream } from "../NabtoDevice";
+import { NabtoDevice, DeviceConfiguration, DeviceOptions, LogMessage, LogSinkOptions, LogRecordCallback, ConnectionEvent, ConnectionEventCallback, DeviceEventCallback, DeviceEvent, ConnectionRef, Connection, ConnectionInfo, CoapMethod, CoapRequestCallback, CoapRequest, AuthorizationRequestCallback, AuthorizationRequest, AuthorizationPolicy, AuthorizationPolicyStats, AuthorizationCacheOptions, AuthorizationCacheStats, Experimental, IceServersRequest, IceServer, StreamCallback, Stream, StreamReadOptions, CoapEndpointStats } from "../NabtoDevice";
+
+import { Duplex, DuplexOptions } from "stream";
+import { StreamDuplex, EOF_ERROR_CODE } from "./StreamDuplex";
 
 var nabto_device = require('bindings')('nabto_device');
 
+// Events and methods cross the native boundary as numbers, so the enums must
+// match the codes of the binding they are loaded with.
+function checkNativeConstants(prefix: string, values: {[key: string]: string | number}) {
+  for (let key of Object.keys(values).filter((k) => isNaN(Number(k)))) {
+    if (nabto_device.constants[prefix + key] !== values[key]) {
+      throw new Error(`Native constant ${prefix}${key} does not match the TypeScript enum`);
+    }
+  }
+}
+checkNativeConstants("CONNECTION_EVENT_", ConnectionEvent);
+checkNativeConstants("DEVICE_EVENT_", DeviceEvent);
+checkNativeConstants("COAP_", CoapMethod);
+
 export class IceServersRequestImpl implements IceServersRequest {
   iceRequest: any;
 
@@ -39,6 +55,10 @@ export class ConnectionImpl implements Connection {
     this.nabtoDevice = dev;
   }
 
+  getInfo(connectionRef: ConnectionRef): ConnectionInfo {
+    return this.nabtoDevice.connectionGetInfo(connectionRef);
+  }
+
   getClientFingerprint(connectionRef: ConnectionRef): string {
     return this.nabtoDevice.connectionGetClientFingerprint(connectionRef);
   }
@@ -63,9 +83,10 @@ export class NabtoDeviceImpl implements NabtoDevice {
 
   connectionEventListeners: ConnectionEventCallback[] = [];
   deviceEventListeners: DeviceEventCallback[] = [];
-  coapEndpoints: CoapEndpointHandler[] = [];
+  coapRouter: CoapRouter | undefined;
   streamListeners: StreamListener[] = [];
   authHandler: AuthRequestHandler | undefined;
+  logCallback: ((logMessage: LogMessage) => void) | undefined;
 
   constructor() {
     this.nabtoDevice = new nabto_device.NabtoDevice();
@@ -75,10 +96,10 @@ export class NabtoDeviceImpl implements NabtoDevice {
 
   stop() {
     this.nabtoDevice.stop();
-    for (let e of this.coapEndpoints) {
-      e.stop();
+    if (this.coapRouter) {
+      this.coapRouter.stop();
     }
-    this.coapEndpoints = [];
+    this.coapRouter = undefined;
     for (let s of this.streamListeners) {
       s.stop();
     }
@@ -110,7 +131,25 @@ export class NabtoDeviceImpl implements NabtoDevice {
   }
 
   setLogCallback(callback: (logMessage: LogMessage) => void) {
-    this.nabtoDevice.setLogCallback(callback);
+    this.logCallback = callback;
+    // Lines logged since the previous delivery arrive together.
+    this.nabtoDevice.setLogCallback((batch: LogMessage[]) => {
+      for (let logMessage of batch) {
+        callback(logMessage);
+      }
+    });
+  }
+
+  getDroppedLogMessages(): number {
+    return this.nabtoDevice.getDroppedLogMessages();
+  }
+
+  setLogSink(opts?: LogSinkOptions) {
+    this.nabtoDevice.setLogSink(opts);
+  }
+
+  setLogRecordCallback(callback: LogRecordCallback, capacity?: number): ArrayBuffer {
+    return this.nabtoDevice.setLogRecordCallback(callback, capacity);
   }
 
   getConfiguration(): DeviceConfiguration {
@@ -140,11 +179,57 @@ export class NabtoDeviceImpl implements NabtoDevice {
     if (this.authHandler == undefined) {
       // Not currently listening
       this.authHandler = new AuthRequestHandler(this.nabtoDevice, fn);
+    } else if (this.authHandler.cb == undefined) {
+      // Listening for a policy
+      this.authHandler.cb = fn;
     } else {
       throw new Error("Multiple Authorization request listeners are not allowed");
     }
   }
 
+  setAuthorizationPolicy(policy?: AuthorizationPolicy | string): void {
+    if (typeof policy === "string") {
+      policy = JSON.parse(policy) as AuthorizationPolicy;
+    }
+    if (this.authHandler == undefined) {
+      if (policy == undefined) {
+        return;
+      }
+      this.authHandler = new AuthRequestHandler(this.nabtoDevice);
+    }
+    this.authHandler.auth.setPolicy(policy);
+  }
+
+  setAuthorizationCache(opts?: AuthorizationCacheOptions): void {
+    if (this.authHandler == undefined) {
+      if (opts == undefined) {
+        return;
+      }
+      this.authHandler = new AuthRequestHandler(this.nabtoDevice);
+    }
+    this.authHandler.auth.setCache(opts);
+  }
+
+  clearAuthorizationCache(connectionRef?: ConnectionRef): void {
+    if (this.authHandler != undefined) {
+      this.authHandler.auth.clearCache(connectionRef);
+    }
+  }
+
+  getAuthorizationCacheStats(): AuthorizationCacheStats | undefined {
+    if (this.authHandler == undefined) {
+      return undefined;
+    }
+    return this.authHandler.auth.getCacheStats();
+  }
+
+  getAuthorizationPolicyStats(): AuthorizationPolicyStats {
+    if (this.authHandler == undefined) {
+      return { allowed: 0, denied: 0, unmatched: 0 };
+    }
+    return this.authHandler.auth.getPolicyStats();
+  }
+
   mdnsAddSubtype(type: string): void {
     return this.nabtoDevice.mdnsAddSubtype(type);
   }
@@ -165,12 +250,23 @@ export class NabtoDeviceImpl implements NabtoDevice {
     return this.nabtoDevice.areServerConnectTokensSync();
   }
 
+  getLiveRequestCounts(): { coap: number, authorization: number } {
+    return this.nabtoDevice.getLiveRequestCounts();
+  }
+
+  getCoapEndpointStats(reset?: boolean): CoapEndpointStats[] {
+    return this.coapRouter ? this.coapRouter.getStats(reset) : [];
+  }
+
   addCoapEndpoint(method: CoapMethod, path: string, cb: CoapRequestCallback): void {
-    this.coapEndpoints.push(new CoapEndpointHandler(this.nabtoDevice, method, path, cb));
+    if (!this.coapRouter) {
+      this.coapRouter = new CoapRouter(this.nabtoDevice, (message: string) => this.logError(message));
+    }
+    this.coapRouter.addEndpoint(method, path, cb);
   }
 
-  addStream(port: number, cb: StreamCallback): number {
-    let s = new StreamListener(this.nabtoDevice, port, cb);
+  addStream(port: number, cb: StreamCallback, opts?: StreamReadOptions): number {
+    let s = new StreamListener(this.nabtoDevice, port, cb, opts);
     this.streamListeners.push(s);
     return s.getStreamPort();
   }
@@ -186,6 +282,13 @@ export class NabtoDeviceImpl implements NabtoDevice {
   connection: Connection;
   experimental: Experimental;
 
+  // Errors of the binding itself are passed to the log callback like the lines logged by the SDK.
+  private logError(message: string): void {
+    if (this.logCallback) {
+      this.logCallback({ message: message, severity: "error" });
+    }
+  }
+
 
   private async startDeviceEventListener(): Promise<void> {
     try {
@@ -215,42 +318,70 @@ export class NabtoDeviceImpl implements NabtoDevice {
   }
 }
 
-export class CoapEndpointHandler {
+// All CoAP endpoints of a device share one native router, which matches request
+// paths natively and calls back into JS with every request that arrived since the
+// last call, as a flat array of handler id, native request and path parameters.
+// A handler which throws is reported through onError and its request is answered
+// with 5.00 unless the handler responded before throwing.
+export class CoapRouter {
   nabtoDevice: any;
-  ep: any;
+  router: any;
+  handlers: CoapRequestCallback[] = [];
+  onError: (message: string) => void;
 
-  cb: CoapRequestCallback;
-
-  constructor(device: any, method: CoapMethod, path: string, cb: CoapRequestCallback) {
+  constructor(device: any, onError: (message: string) => void) {
     this.nabtoDevice = device;
-    this.cb = cb;
-    this.ep = new nabto_device.CoapEndpoint(device, method, path);
-    this.nextReq();
-  }
-
-  stop(): void {
-    this.ep.stop();
+    this.onError = onError;
+    this.router = new nabto_device.CoapRouter(device, (batch: any[]) => {
+      for (let i = 0; i < batch.length; i += 3) {
+        let req: CoapRequestImpl | undefined = undefined;
+        try {
+          req = new CoapRequestImpl(this.nabtoDevice, batch[i + 1], batch[i + 2], this.router);
+          this.handlers[batch[i]](req);
+        } catch (err) {
+          this.handlerFailed(req, err);
+        }
+      }
+    });
   }
 
-  async nextReq(): Promise<void> {
+  // Must not throw, an exception leaving the native callback is fatal.
+  private handlerFailed(req: CoapRequestImpl | undefined, err: any): void {
     try {
-      await this.ep.notifyRequest();
-      let nativeReq = this.ep.getCurrentRequest();
-      let req = new CoapRequestImpl(nativeReq);
-      this.cb(req);
-      this.nextReq();
-    } catch (err) {
-      // TODO: handle... probably just closing down
+      this.onError(`CoAP handler failed: ${err instanceof Error ? err.message : String(err)}`);
+    } catch (e) {
+      // The log callback failing is not a reason to leave the request unanswered.
     }
+    try {
+      if (req && !req.req.isResponded()) {
+        req.sendErrorResponse(500, "Internal error");
+      }
+    } catch (e) {
+      // The request is freed when collected.
+    }
+  }
 
+  addEndpoint(method: CoapMethod, path: string, cb: CoapRequestCallback): void {
+    let id: number = this.router.addRoute(method, path);
+    this.handlers[id] = cb;
+  }
+
+  stop(): void {
+    this.router.stop();
+  }
+
+  getStats(reset?: boolean): CoapEndpointStats[] {
+    return this.router.getStats(reset);
   }
 }
 
 export class CoapRequestImpl implements CoapRequest {
   req: any;
+  params?: { [name: string]: string };
 
-  constructor(nativeReq: any) {
-    this.req = new nabto_device.CoapRequest(nativeReq);
+  constructor(device: any, nativeReq: any, params?: { [name: string]: string }, router?: any) {
+    this.req = new nabto_device.CoapRequest(device, nativeReq, router);
+    this.params = params;
   }
 
   getFormat(): Number {
@@ -266,6 +397,9 @@ export class CoapRequestImpl implements CoapRequest {
   }
 
   getParameter(parameterName: string): string {
+    if (this.params && parameterName in this.params) {
+      return this.params[parameterName];
+    }
     return this.req.getParameter(parameterName);
   }
 
@@ -277,7 +411,7 @@ export class CoapRequestImpl implements CoapRequest {
     return this.req.setResponseCode(code);
   }
 
-  setResponsePayload(format: Number, payload: ArrayBuffer): void {
+  setResponsePayload(format: Number, payload: ArrayBuffer | ArrayBufferView): void {
     return this.req.setResponsePayload(format, payload);
   }
 
@@ -285,6 +419,10 @@ export class CoapRequestImpl implements CoapRequest {
     return this.req.responseReady();
   }
 
+  respond(code: number, format?: number, payload?: ArrayBuffer | ArrayBufferView): void {
+    return this.req.respond(code, format, payload);
+  }
+
 }
 
 export class StreamListener {
@@ -292,10 +430,12 @@ export class StreamListener {
   listener: any;
 
   cb: StreamCallback;
+  readOptions: StreamReadOptions;
 
-  constructor(device: any, port: number, cb: StreamCallback) {
+  constructor(device: any, port: number, cb: StreamCallback, opts?: StreamReadOptions) {
     this.nabtoDevice = device;
     this.cb = cb;
+    this.readOptions = opts ?? {};
     this.listener = new nabto_device.StreamListener(device, port);
     this.nextStream();
   }
@@ -312,7 +452,7 @@ export class StreamListener {
     try {
       await this.listener.notifyStream();
       let nativeStream = this.listener.getCurrentStream();
-      let stream = new StreamImpl(this.nabtoDevice, nativeStream);
+      let stream = new StreamImpl(this.nabtoDevice, nativeStream, this.readOptions);
       this.cb(stream);
       this.nextStream();
     } catch (err) {
@@ -321,11 +461,61 @@ export class StreamListener {
   }
 }
 
+const DEFAULT_READ_CHUNK_SIZE = 1024;
+const DEFAULT_MIN_READ_CHUNK_SIZE = 1024;
+const DEFAULT_MAX_READ_CHUNK_SIZE = 256*1024;
+// Stream::MAX_READ_LENGTH in the native code.
+const MAX_READ_LENGTH = 16*1024*1024;
+
 export class StreamImpl implements Stream {
   stream: any;
+  readChunkSize: number = DEFAULT_READ_CHUNK_SIZE;
+  adaptiveReadSize: boolean = false;
+  minReadChunkSize: number = DEFAULT_MIN_READ_CHUNK_SIZE;
+  maxReadChunkSize: number = DEFAULT_MAX_READ_CHUNK_SIZE;
 
-  constructor(device: any, nativeStream: any) {
+  constructor(device: any, nativeStream: any, opts?: StreamReadOptions) {
     this.stream = new nabto_device.Stream(device, nativeStream);
+    if (opts) {
+      this.setReadOptions(opts);
+    }
+  }
+
+  // The options are validated before any of them is applied, so a call which throws changes nothing.
+  setReadOptions(opts: StreamReadOptions): void {
+    let min = opts.minReadChunkSize ?? this.minReadChunkSize;
+    let max = opts.maxReadChunkSize ?? this.maxReadChunkSize;
+    let chunkSize = opts.readChunkSize ?? this.readChunkSize;
+    if (!(min >= 1 && max >= min && max <= MAX_READ_LENGTH)) {
+      throw new RangeError("Invalid read chunk size bounds");
+    }
+    if (!(chunkSize >= 1 && chunkSize <= MAX_READ_LENGTH)) {
+      throw new RangeError(`readChunkSize must be from 1 to ${MAX_READ_LENGTH}`);
+    }
+    this.minReadChunkSize = min;
+    this.maxReadChunkSize = max;
+    this.readChunkSize = chunkSize;
+    if (opts.adaptiveReadSize !== undefined) {
+      this.adaptiveReadSize = opts.adaptiveReadSize;
+    }
+    if (this.adaptiveReadSize) {
+      this.readChunkSize = Math.min(Math.max(this.readChunkSize, this.minReadChunkSize), this.maxReadChunkSize);
+    }
+  }
+
+  getReadChunkSize(): number {
+    return this.readChunkSize;
+  }
+
+  private adaptReadSize(readLength: number) {
+    if (!this.adaptiveReadSize) {
+      return;
+    }
+    if (readLength >= this.readChunkSize) {
+      this.readChunkSize = Math.min(this.readChunkSize * 2, this.maxReadChunkSize);
+    } else if (readLength < this.readChunkSize / 4) {
+      this.readChunkSize = Math.max(Math.floor(this.readChunkSize / 2), this.minReadChunkSize);
+    }
   }
 
   accept(): Promise<void> {
@@ -337,21 +527,36 @@ export class StreamImpl implements Stream {
   }
 
   readSome(): Promise<ArrayBuffer> {
-    return this.stream.readSome().then(() => {
-      return this.stream.getData();
+    return this.stream.readSome(this.readChunkSize).then((data: ArrayBuffer) => {
+      this.adaptReadSize(data.byteLength);
+      return data;
     });
   }
 
   readAll(length: number): Promise<ArrayBuffer> {
-    return this.stream.readAll(length).then(() => {
-      return this.stream.getData();
-    });
+    return this.stream.readAll(length);
   }
 
-  write(data: ArrayBuffer): Promise<void> {
+  readInto(buf: Uint8Array, offset?: number, length?: number): Promise<number> {
+    return this.stream.readInto(buf, offset, length);
+  }
+
+  write(data: ArrayBuffer | ArrayBufferView): Promise<void> {
     return this.stream.write(data);
   }
 
+  writev(chunks: (ArrayBuffer | ArrayBufferView)[]): Promise<void> {
+    return this.stream.writev(chunks);
+  }
+
+  setWriteWindow(window: number): void {
+    this.stream.setWriteWindow(window);
+  }
+
+  getWriteWindow(): number {
+    return this.stream.getWriteWindow();
+  }
+
   close(): Promise<void> {
     return this.stream.close()
   }
@@ -359,15 +564,40 @@ export class StreamImpl implements Stream {
   abort(): void {
     return this.stream.abort();
   }
+
+  createDuplex(opts?: DuplexOptions): Duplex {
+    return new StreamDuplex(this, opts);
+  }
+
+  startReading(onData: (data: Buffer) => void, onEnd: (err?: Error) => void, bufferSize?: number): void {
+    this.stream.startReading((data: Buffer | undefined, err?: any) => {
+      if (data !== undefined) {
+        onData(data);
+      } else if (err.code == EOF_ERROR_CODE) {
+        onEnd();
+      } else {
+        onEnd(err);
+      }
+    }, bufferSize);
+  }
+
+  pauseReading(): void {
+    this.stream.pauseReading();
+  }
+
+  resumeReading(): void {
+    this.stream.resumeReading();
+  }
 }
 
 export class AuthRequestHandler {
   nabtoDevice: any;
   auth: any;
 
-  cb: AuthorizationRequestCallback;
+  // Requests not matched by the policy are denied while there is no callback.
+  cb: AuthorizationRequestCallback | undefined;
 
-  constructor(device: any, cb: AuthorizationRequestCallback) {
+  constructor(device: any, cb?: AuthorizationRequestCallback) {
     this.nabtoDevice = device;
     this.cb = cb;
     this.auth = new nabto_device.AuthHandler(device);
@@ -382,8 +612,12 @@ export class AuthRequestHandler {
     try {
       await this.auth.notifyRequest();
       let nativeReq = this.auth.getCurrentRequest();
-      let req = new AuthorizationRequestImpl(nativeReq);
-      this.cb(req);
+      let req = new AuthorizationRequestImpl(this.nabtoDevice, nativeReq, this.auth);
+      if (this.cb) {
+        this.cb(req);
+      } else {
+        req.verdict(false);
+      }
       this.nextReq();
     } catch (err) {
       // TODO: handle... probably just closing down
@@ -395,8 +629,8 @@ export class AuthRequestHandler {
 export class AuthorizationRequestImpl implements AuthorizationRequest {
   req: any;
 
-  constructor(nativeReq: any) {
-    this.req = new nabto_device.AuthRequest(nativeReq);
+  constructor(device: any, nativeReq: any, handler?: any) {
+    this.req = new nabto_device.AuthRequest(device, nativeReq, handler);
   }
 
   verdict(allowed: Boolean): void {
@@ -414,4 +648,15 @@ export class AuthorizationRequestImpl implements AuthorizationRequest {
   getAttributes(): { [key: string]: string } {
     return this.req.getAttributes();
   }
+
+  getAttribute(name: string): string | undefined {
+    return this.req.getAttribute(name);
+  }
+
+  *attributes(): IterableIterator<[string, string]> {
+    let count = this.req.getAttributeCount();
+    for (let i = 0; i < count; i++) {
+      yield this.req.getAttributeAt(i);
+    }
+  }
 }
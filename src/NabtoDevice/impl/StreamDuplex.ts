@@ -0,0 +1,88 @@
+import { Duplex, DuplexOptions } from "stream";
+import { Stream } from "../NabtoDevice";
+
+export const EOF_ERROR_CODE = "NABTO_DEVICE_EC_EOF";
+
+// Node.js Duplex on top of a Nabto stream. The Readable side is fed by the native
+// read pump with a ring of readableHighWaterMark bytes, which keeps reading ahead
+// on the SDK thread. The pump is paused while push() reports the Readable full and
+// resumed by _read(), so read-ahead is bounded by the ring. The Writable side pipelines native
+// writes up to the stream write window, chunks buffered while the window is full
+// go out together as one writev(), and end() closes the Nabto stream for writing
+// after the outstanding writes.
+export class StreamDuplex extends Duplex {
+  stream: Stream;
+  reading: boolean = false;
+  writesInFlight: number = 0;
+
+  constructor(stream: Stream, opts?: DuplexOptions) {
+    super(opts);
+    this.stream = stream;
+  }
+
+  _read(size: number): void {
+    if (this.reading) {
+      this.stream.resumeReading();
+      return;
+    }
+    this.reading = true;
+    // The pump hands out a new Buffer per delivery, so it is pushed without copying.
+    this.stream.startReading((data) => {
+      if (!this.push(data)) {
+        this.stream.pauseReading();
+      }
+    }, (err) => {
+      if (err) {
+        this.destroy(err);
+      } else {
+        this.push(null);
+      }
+    }, this.readableHighWaterMark);
+  }
+
+  _write(chunk: Buffer, encoding: BufferEncoding, callback: (error?: Error | null) => void): void {
+    this.pipeline((copy) => this.stream.write(copy ? Buffer.from(chunk) : chunk), callback);
+  }
+
+  _writev(chunks: Array<{ chunk: Buffer, encoding: BufferEncoding }>, callback: (error?: Error | null) => void): void {
+    this.pipeline((copy) => this.stream.writev(chunks.map((c) => copy ? Buffer.from(c.chunk) : c.chunk)), callback);
+  }
+
+  // While the window has room the Writable is told the write is done right away, so the
+  // next chunk is submitted without waiting a round trip. Otherwise it waits for this
+  // write. Native writes send the caller's memory in place and the caller may reuse a
+  // chunk once it is acknowledged, so chunks acknowledged early are written from a copy.
+  // A failed write that was already acknowledged destroys the Duplex.
+  private pipeline(submit: (copy: boolean) => Promise<void>, callback: (error?: Error | null) => void): void {
+    this.writesInFlight++;
+    let acknowledged = this.writesInFlight < this.stream.getWriteWindow();
+    let write = submit(acknowledged);
+    if (acknowledged) {
+      callback();
+    }
+    write.then(() => {
+      this.writesInFlight--;
+      if (!acknowledged) {
+        callback();
+      }
+    }, (err) => {
+      this.writesInFlight--;
+      if (!acknowledged) {
+        callback(err);
+      } else {
+        this.destroy(err);
+      }
+    });
+  }
+
+  _final(callback: (error?: Error | null) => void): void {
+    this.stream.close().then(() => callback(), callback);
+  }
+
+  _destroy(error: Error | null, callback: (error?: Error | null) => void): void {
+    if (!this.writableFinished || !this.readableEnded) {
+      this.stream.abort();
+    }
+    callback(error);
+  }
+}
@@ -82,7 +82,7 @@ describe('connect local', () => {
         try {
           expect(ev).to.exist;
           expect(ev).to.equal(ConnectionEvent.OPENED);
-          expect(ref).to.exist;
+          expect(ref).to.exist.and.be.a("bigint");
           connRef = ref;
         } catch (err) {
           console.log(err);
@@ -124,6 +124,12 @@ describe('connect local', () => {
     expect(isLocal).to.be.a("Boolean");
     expect(isLocal).to.be.true;
 
+    let info = dev.connection.getInfo(connRef);
+    expect(info.clientFingerprint).to.equal(cliFp);
+    expect(info.isLocal).to.be.true;
+    expect(info.isPasswordAuthenticated).to.be.false;
+    expect(info.passwordAuthenticationUsername).to.be.undefined;
+
     await conn.close();
     let res2 = await prom2;
     expect(res2).to.be.true;
@@ -162,7 +168,7 @@ describe('connect local', () => {
       }
 
       let ref = req.getConnectionRef();
-      expect(ref).to.exist.and.be.a("Number");
+      expect(ref).to.exist.and.be.a("bigint");
 
       req.setResponseCode(205);
       let buf = new ArrayBuffer(data.length);
@@ -210,6 +216,8 @@ describe('connect local', () => {
       }
       req.setResponsePayload(0, buf);
       req.responseReady();
+      // The payload view is detached once the response is sent.
+      expect(payload.byteLength).to.equal(0);
     });
     await dev.start();
     cli = NabtoClientFactory.create();
@@ -232,4 +240,136 @@ describe('connect local', () => {
     expect(called).to.be.true;
   });
 
+  it('coap router dispatch', async () => {
+    let respond = (code: number) => (req: CoapRequest) => {
+      req.setResponseCode(code);
+      req.responseReady();
+    };
+    dev.addCoapEndpoint(CoapMethod.GET, '/things/{id}', (req: CoapRequest) => {
+      expect(req.getParameter("id")).to.equal("42");
+      respond(201)(req);
+    });
+    dev.addCoapEndpoint(CoapMethod.GET, '/things/all', respond(202));
+    dev.addCoapEndpoint(CoapMethod.POST, '/things/{id}', respond(203));
+    dev.addCoapEndpoint(CoapMethod.GET, '/things/{id}/{prop}', respond(204));
+    expect(() => dev.addCoapEndpoint(CoapMethod.GET, '/things/{other}', respond(205))).to.throw();
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+
+    let status = async (method: string, path: string) => {
+      return (await conn!.createCoapRequest(method, path).execute()).getResponseStatusCode();
+    };
+    expect(await status("GET", "/things/42")).to.equal(201);
+    expect(await status("GET", "/things/all")).to.equal(202);
+    expect(await status("POST", "/things/42")).to.equal(203);
+    expect(await status("GET", "/things/42/name")).to.equal(204);
+    expect(await status("GET", "/other/42")).to.equal(404);
+  });
+
+  it('coap request burst', async () => {
+    let handled = 0;
+    dev.addCoapEndpoint(CoapMethod.GET, '/burst/{n}', (req: CoapRequest) => {
+      handled++;
+      req.setResponseCode(205);
+      req.responseReady();
+    });
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+
+    let requests = [];
+    for (let i = 0; i < 50; i++) {
+      requests.push(conn.createCoapRequest("GET", `/burst/${i}`).execute());
+    }
+    let responses = await Promise.all(requests);
+    for (let r of responses) {
+      expect(r.getResponseStatusCode()).to.equal(205);
+    }
+    expect(handled).to.equal(50);
+    // Requests are freed as soon as they are responded to.
+    expect(dev.getLiveRequestCounts().coap).to.equal(0);
+
+    let stats = dev.getCoapEndpointStats(true);
+    expect(stats.length).to.equal(1);
+    expect(stats[0].method).to.equal(CoapMethod.GET);
+    expect(stats[0].path).to.equal('/burst/{n}');
+    expect(stats[0].total.count).to.equal(50);
+    expect(stats[0].total.p99).to.be.at.least(stats[0].total.p50);
+    expect(dev.getCoapEndpointStats()[0].total.count).to.equal(0);
+  });
+
+  it('coap handler which throws', async () => {
+    let errors: string[] = [];
+    dev.setLogCallback((logMessage: LogMessage) => {
+      if (logMessage.severity == "error") {
+        errors.push(logMessage.message);
+      }
+    });
+    dev.addCoapEndpoint(CoapMethod.GET, '/fail/before', (req: CoapRequest) => {
+      throw new Error("before responding");
+    });
+    dev.addCoapEndpoint(CoapMethod.GET, '/fail/after', (req: CoapRequest) => {
+      req.respond(205);
+      throw new Error("after responding");
+    });
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+
+    let status = async (path: string) => {
+      return (await conn!.createCoapRequest("GET", path).execute()).getResponseStatusCode();
+    };
+    expect(await status("/fail/before")).to.equal(500);
+    expect(await status("/fail/after")).to.equal(205);
+    expect(errors.some((e) => e.includes("before responding"))).to.be.true;
+    expect(errors.some((e) => e.includes("after responding"))).to.be.true;
+    expect(dev.getLiveRequestCounts().coap).to.equal(0);
+  });
+
+  it('coap respond with buffer view', async () => {
+    let data = "Hello world";
+    dev.addCoapEndpoint(CoapMethod.GET, '/hello/view', (req: CoapRequest) => {
+      let padded = Buffer.from("xx" + data + "xx");
+      req.respond(205, 0, padded.subarray(2, 2 + data.length));
+    });
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+    const coapResp = await conn.createCoapRequest("GET", '/hello/view').execute();
+
+    expect(coapResp.getResponseStatusCode()).to.equal(205);
+    expect(coapResp.getResponseContentFormat()).to.equal(0);
+    expect((Buffer.from(coapResp.getResponsePayload())).toString('utf8')).to.equal(data);
+  });
+
+  it('coap respond with content format and no payload', async () => {
+    dev.addCoapEndpoint(CoapMethod.GET, '/hello/format', (req: CoapRequest) => {
+      expect(() => req.respond(205, "json" as any)).to.throw();
+      req.respond(205, 50);
+    });
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+    const coapResp = await conn.createCoapRequest("GET", '/hello/format').execute();
+
+    expect(coapResp.getResponseStatusCode()).to.equal(205);
+    expect(coapResp.getResponseContentFormat()).to.equal(50);
+  });
+
 });
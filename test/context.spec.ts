@@ -1,8 +1,11 @@
 import 'mocha'
 import { strict as assert } from 'node:assert';
 import chai from 'chai';
+import { readFileSync, rmSync } from 'node:fs';
+import { tmpdir } from 'node:os';
+import { join } from 'node:path';
 
-import { DeviceEvent, DeviceOptions, LogMessage, NabtoDevice, NabtoDeviceFactory } from '../src/NabtoDevice/NabtoDevice'
+import { DeviceEvent, DeviceOptions, forEachLogRecord, LogMessage, LogRecord, LogSeverity, NabtoDevice, NabtoDeviceFactory } from '../src/NabtoDevice/NabtoDevice'
 
 const expect = chai.expect;
 
@@ -142,6 +145,77 @@ describe('lifecycle', () => {
     });
   });
 
+  it('log level filtering', async () => {
+    let opts: DeviceOptions = {
+        productId: "pr-foobar",
+        deviceId: "de-foobar",
+        privateKey: dev.createPrivateKey(),
+        localPort: 0,
+        p2pPort: 0,
+    }
+    dev.setOptions(opts);
+    dev.setLogLevel("info");
+    let severities: string[] = [];
+    dev.setLogCallback((logMessage: LogMessage) => {
+        severities.push(logMessage.severity);
+    });
+    await dev.start();
+    await new Promise((resolve) => setTimeout(resolve, 200));
+    expect(severities).to.not.include("trace");
+    expect(dev.getDroppedLogMessages()).to.equal(0);
+  });
+
+  it('log sink', async () => {
+    let path = join(tmpdir(), `nabto-log-sink-${process.pid}.log`);
+    rmSync(path, { force: true });
+    let opts: DeviceOptions = {
+        productId: "pr-foobar",
+        deviceId: "de-foobar",
+        privateKey: dev.createPrivateKey(),
+        localPort: 0,
+        p2pPort: 0,
+    }
+    dev.setOptions(opts);
+    dev.setLogLevel("info");
+    dev.setLogSink({ path: path, format: "json" });
+    await dev.start();
+    // Removing the sink flushes it.
+    dev.setLogSink();
+    let lines = readFileSync(path, 'utf8').split("\n").filter((l) => l.length > 0);
+    rmSync(path, { force: true });
+    expect(lines.length).to.be.greaterThan(0);
+    for (let line of lines) {
+        let record = JSON.parse(line);
+        expect(record.message).to.be.a("string");
+        expect(record.severity).to.not.equal("trace");
+    }
+  });
+
+  it('binary log records', async () => {
+    let opts: DeviceOptions = {
+        productId: "pr-foobar",
+        deviceId: "de-foobar",
+        privateKey: dev.createPrivateKey(),
+        localPort: 0,
+        p2pPort: 0,
+    }
+    dev.setOptions(opts);
+    dev.setLogLevel("info");
+    let records: LogRecord[] = [];
+    let ring = dev.setLogRecordCallback((buf, offset, length) => {
+        expect(buf).to.equal(ring);
+        forEachLogRecord(buf, offset, length, (r) => records.push(r));
+    });
+    await dev.start();
+    await new Promise((resolve) => setTimeout(resolve, 200));
+    expect(records.length).to.be.greaterThan(0);
+    for (let r of records) {
+        expect(r.severity).to.be.at.most(LogSeverity.INFO);
+        expect(r.message).to.be.a("string");
+        expect(r.time).to.be.closeTo(Date.now(), 60000);
+    }
+  });
+
   it('set basestation attach', () => {
     dev.setBasestationAttach(true);
     dev.setBasestationAttach(false);
@@ -160,6 +160,8 @@ describe.only('streaming', () => {
     dev.addStream(4242, async (stream) => {
       try {
         await stream.accept();
+        expect(() => stream.readAll(0xffffffff)).to.throw(RangeError);
+        expect(() => stream.startReading(() => {}, () => {}, 4e9)).to.throw(RangeError);
         let readBuf = await stream.readAll(6);
         expect(readBuf.byteLength).to.equal(6);
         let readBufStr = stringFromBuffer(readBuf);
@@ -191,6 +193,108 @@ describe.only('streaming', () => {
     stream.abort();
   });
 
+  it('stream readInto', async () => {
+    let testData = "hello World";
+    let buf = bufferFromString(testData);
+
+    let resolver: (value: void | PromiseLike<void>) => void;
+    let rejecter: (value: any | PromiseLike<any>) => void;
+    const p = new Promise<void>((resolve, reject) => {
+      resolver = resolve;
+      rejecter = reject;
+    })
+
+    dev.addStream(4242, async (stream) => {
+      try {
+        await stream.accept();
+        let target = Buffer.alloc(64);
+        expect(() => stream.readInto(target, -1)).to.throw(RangeError);
+        expect(() => stream.readInto(target, NaN)).to.throw(RangeError);
+        expect(() => stream.readInto(target, 1.5)).to.throw(RangeError);
+        expect(() => stream.readInto(target, 0, 2.5)).to.throw(RangeError);
+        expect(() => stream.readInto(target, 60, 8)).to.throw(RangeError);
+        let offset = 4;
+        let received = 0;
+        while (received < buf.byteLength) {
+          received += await stream.readInto(target, offset + received);
+        }
+        expect(received).to.equal(buf.byteLength);
+        expect(target.subarray(offset, offset + received).toString('utf8')).to.equal(testData);
+        resolver();
+      } catch (err) {
+        rejecter(err);
+      }
+    });
+    await dev.start();
+
+    [cli, conn] = createClientWithConn();
+    await conn.connect();
+
+    let stream = conn.createStream();
+    await stream.open(4242).catch((err) => {expect(err).to.be.undefined});
+
+    await stream.write(buf);
+
+    await p;
+
+    await stream.close().catch((err) => {expect(err).to.be.undefined});
+    stream.abort();
+  });
+
+  it('stream read chunk size', async () => {
+    let testData = "hello World";
+    let buf = bufferFromString(testData);
+
+    let resolver: (value: void | PromiseLike<void>) => void;
+    let rejecter: (value: any | PromiseLike<any>) => void;
+    const p = new Promise<void>((resolve, reject) => {
+      resolver = resolve;
+      rejecter = reject;
+    })
+
+    dev.addStream(4242, async (stream) => {
+      try {
+        await stream.accept();
+        expect(stream.getReadChunkSize()).to.equal(4);
+        let readBuf = await stream.readSome();
+        expect(readBuf.byteLength).to.be.lessThanOrEqual(4);
+
+        // A rejected call leaves the options as they were.
+        expect(() => stream.setReadOptions({minReadChunkSize: 16, maxReadChunkSize: 8})).to.throw(RangeError);
+        expect(() => stream.setReadOptions({minReadChunkSize: 2, readChunkSize: 0})).to.throw(RangeError);
+        expect(stream.getReadChunkSize()).to.equal(4);
+        stream.setReadOptions({adaptiveReadSize: true, minReadChunkSize: 2, maxReadChunkSize: 8});
+        let received = readBuf.byteLength;
+        while (received < buf.byteLength) {
+          let before = stream.getReadChunkSize();
+          let chunk = await stream.readSome();
+          expect(chunk.byteLength).to.be.lessThanOrEqual(before);
+          if (chunk.byteLength == before) {
+            expect(stream.getReadChunkSize()).to.equal(Math.min(before * 2, 8));
+          }
+          received += chunk.byteLength;
+        }
+        resolver();
+      } catch (err) {
+        rejecter(err);
+      }
+    }, { readChunkSize: 4 });
+    await dev.start();
+
+    [cli, conn] = createClientWithConn();
+    await conn.connect();
+
+    let stream = conn.createStream();
+    await stream.open(4242).catch((err) => {expect(err).to.be.undefined});
+
+    await stream.write(buf);
+
+    await p;
+
+    await stream.close().catch((err) => {expect(err).to.be.undefined});
+    stream.abort();
+  });
+
   it('stream write', async () => {
     let testData = "hello World";
     let buf = bufferFromString(testData);
@@ -220,6 +324,197 @@ describe.only('streaming', () => {
     stream.abort();
   });
 
+  it('stream writev', async () => {
+    let header = Buffer.from([0, 11]);
+    let payload = Buffer.from("xxhello Worldxx").subarray(2, 13);
+
+    dev.addStream(4242, async (stream) => {
+      try {
+        await stream.accept();
+        await stream.writev([header, new Uint8Array(0), payload]);
+      } catch (err) {
+        console.log("Stream failure!: ", err);
+      }
+    });
+    await dev.start();
+
+    [cli, conn] = createClientWithConn();
+    await conn.connect();
+
+    let stream = conn.createStream();
+    await stream.open(4242).catch((err) => {expect(err).to.be.undefined});
+
+    let received = Buffer.alloc(0);
+    while (received.byteLength < 13) {
+      received = Buffer.concat([received, Buffer.from(await stream.readSome())]);
+    }
+    expect(received.subarray(0, 2)).to.deep.equal(header);
+    expect(received.subarray(2).toString('utf8')).to.equal("hello World");
+
+    await stream.close().catch((err) => {expect(err).to.be.undefined});
+    stream.abort();
+  });
+
+  it('stream pipelined writes', async () => {
+    let parts = ["hello", " ", "World", "!"];
+
+    dev.addStream(4242, async (stream) => {
+      try {
+        await stream.accept();
+        stream.setWriteWindow(3);
+        expect(stream.getWriteWindow()).to.equal(3);
+        let writes = parts.slice(0, 3).map((p) => stream.write(Buffer.from(p)));
+        try {
+          await stream.write(Buffer.from(parts[3]));
+          expect(false).to.be.true;
+        } catch (err: any) {
+          expect(err.code).to.equal("NABTO_DEVICE_EC_OPERATION_IN_PROGRESS");
+        }
+        await Promise.all(writes);
+        await stream.write(Buffer.from(parts[3]));
+        await stream.close();
+      } catch (err) {
+        console.log("Stream failure!: ", err);
+      }
+    });
+    await dev.start();
+
+    [cli, conn] = createClientWithConn();
+    await conn.connect();
+
+    let stream = conn.createStream();
+    await stream.open(4242).catch((err) => {expect(err).to.be.undefined});
+
+    let received = "";
+    try {
+      while (true) {
+        received += stringFromBuffer(await stream.readSome());
+      }
+    } catch (err) {
+      // EOF after the device closes
+    }
+    expect(received).to.equal(parts.join(""));
+
+    await stream.close().catch((err) => {expect(err).to.be.undefined});
+    stream.abort();
+  });
+
+  it('stream duplex echo', async () => {
+    let testData = "hello World";
+    let buf = bufferFromString(testData);
+
+    dev.addStream(4242, async (stream) => {
+      try {
+        await stream.accept();
+        let duplex = stream.createDuplex({ highWaterMark: 4096 });
+        duplex.pipe(duplex);
+      } catch (err) {
+        console.log("Stream failure!: ", err);
+      }
+    });
+    await dev.start();
+
+    [cli, conn] = createClientWithConn();
+    await conn.connect();
+
+    let stream = conn.createStream();
+    await stream.open(4242).catch((err) => {expect(err).to.be.undefined});
+
+    await stream.write(buf);
+    await stream.close();
+
+    let echoed = "";
+    try {
+      while (true) {
+        echoed += stringFromBuffer(await stream.readSome());
+      }
+    } catch (err) {
+      // EOF once the device side has echoed everything and closed
+    }
+    expect(echoed).to.equal(testData);
+    stream.abort();
+  });
+
+  it('stream duplex echo with small highWaterMark', async () => {
+    // Far more than the readable buffer, so the read pump is paused and resumed.
+    let testData = "0123456789abcdef".repeat(1024);
+    let buf = bufferFromString(testData);
+
+    dev.addStream(4242, async (stream) => {
+      try {
+        await stream.accept();
+        let duplex = stream.createDuplex({ highWaterMark: 64 });
+        duplex.pipe(duplex);
+      } catch (err) {
+        console.log("Stream failure!: ", err);
+      }
+    });
+    await dev.start();
+
+    [cli, conn] = createClientWithConn();
+    await conn.connect();
+
+    let stream = conn.createStream();
+    await stream.open(4242).catch((err) => {expect(err).to.be.undefined});
+
+    await stream.write(buf);
+    await stream.close();
+
+    let echoed = "";
+    try {
+      while (true) {
+        echoed += stringFromBuffer(await stream.readSome());
+      }
+    } catch (err) {
+      // EOF once the device side has echoed everything and closed
+    }
+    expect(echoed).to.equal(testData);
+    stream.abort();
+  });
+
+  it('stream flowing read', async () => {
+    let testData = "hello World";
+    let buf = bufferFromString(testData);
+
+    let resolver: (value: string | PromiseLike<string>) => void;
+    let rejecter: (value: any | PromiseLike<any>) => void;
+    const p = new Promise<string>((resolve, reject) => {
+      resolver = resolve;
+      rejecter = reject;
+    })
+
+    dev.addStream(4242, async (stream) => {
+      try {
+        await stream.accept();
+        let received = "";
+        stream.startReading((data) => {
+          received += data.toString('utf8');
+        }, (err) => {
+          if (err) {
+            rejecter(err);
+          } else {
+            resolver(received);
+          }
+        }, 4);
+      } catch (err) {
+        rejecter(err);
+      }
+    });
+    await dev.start();
+
+    [cli, conn] = createClientWithConn();
+    await conn.connect();
+
+    let stream = conn.createStream();
+    await stream.open(4242).catch((err) => {expect(err).to.be.undefined});
+
+    await stream.write(buf);
+    await stream.close();
+
+    expect(await p).to.equal(testData);
+    stream.abort();
+  });
+
   it('stream close', async () => {
     let testData = "hello World";
     let buf = bufferFromString(testData);
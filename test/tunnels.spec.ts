@@ -2,7 +2,7 @@ import 'mocha'
 import chai from 'chai';
 import { env } from 'process';
 import { Connection, NabtoClient, NabtoClientFactory } from 'edge-client-node'
-import { AuthorizationRequest, DeviceOptions, LogMessage, NabtoDevice, NabtoDeviceFactory } from '../src/NabtoDevice/NabtoDevice';
+import { AuthorizationRequest, CoapMethod, CoapRequest, ConnectionRef, DeviceOptions, LogMessage, NabtoDevice, NabtoDeviceFactory } from '../src/NabtoDevice/NabtoDevice';
 import { decode } from 'cbor-x';
 import express, {Request, Response, NextFunction} from 'express';
 import { randomInt } from 'crypto';
@@ -92,7 +92,7 @@ describe('tunnels', () => {
         let action = req.getAction();
         expect(action).to.equal("TcpTunnel:ListServices");
         let ref = req.getConnectionRef();
-        expect(ref).to.exist.and.be.a("Number");
+        expect(ref).to.exist.and.be.a("bigint");
         let att = req.getAttributes();
         let keys = Object.keys(att);
         expect(keys).to.be.an('Array').and.have.length(0);
@@ -120,7 +120,7 @@ describe('tunnels', () => {
         let action = req.getAction();
         expect(action).to.equal("TcpTunnel:ListServices");
         let ref = req.getConnectionRef();
-        expect(ref).to.exist.and.be.a("Number");
+        expect(ref).to.exist.and.be.a("bigint");
         let att = req.getAttributes();
         let keys = Object.keys(att);
         expect(keys).to.be.an('Array').and.have.length(0);
@@ -171,6 +171,136 @@ describe('tunnels', () => {
   });
 
 
+  it('authorization policy', async () => {
+    let called: string[] = [];
+    dev.onAuthorizationRequest((req: AuthorizationRequest) => {
+        called.push(req.getAction());
+        expect(req.getAttribute("TcpTunnel:ServiceId")).to.equal("foo");
+        expect(req.getAttribute("TcpTunnel:Missing")).to.be.undefined;
+        expect(Array.from(req.attributes())).to.deep.include(["TcpTunnel:ServiceId", "foo"]);
+        req.verdict(true);
+    });
+    dev.setAuthorizationPolicy(JSON.stringify({
+      policies: [{ id: "Tunnels", statements: [
+        { effect: "Allow", actions: ["TcpTunnel:ListServices"] },
+        { effect: "Deny", actions: ["TcpTunnel:*"], conditions: [{ stringEquals: { "TcpTunnel:ServiceId": "secret" } }] }
+      ]}],
+      roles: [{ id: "Guest", policies: ["Tunnels"] }],
+      defaultRole: "Guest"
+    }));
+    dev.addTcpTunnelService("foo", "bar", "127.0.0.1", 8080);
+    dev.addTcpTunnelService("secret", "bar", "127.0.0.1", 8081);
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+
+    let list = await conn.createCoapRequest("GET", '/tcp-tunnels/services').execute();
+    expect(list.getResponseStatusCode()).to.equal(205);
+    let secret = await conn.createCoapRequest("GET", '/tcp-tunnels/services/secret').execute();
+    expect(secret.getResponseStatusCode()).to.equal(403);
+    expect(called).to.have.length(0);
+
+    // Not decided by the policy, so it goes to the callback.
+    let foo = await conn.createCoapRequest("GET", '/tcp-tunnels/services/foo').execute();
+    expect(foo.getResponseStatusCode()).to.equal(205);
+    expect(called).to.deep.equal(["TcpTunnel:GetService"]);
+    expect(dev.getAuthorizationPolicyStats()).to.deep.equal({ allowed: 1, denied: 1, unmatched: 1 });
+
+    expect(() => dev.setAuthorizationPolicy({ policies: [], roles: [{ id: "Guest", policies: ["Missing"] }] })).to.throw();
+  });
+
+  it('authorization cache', async () => {
+    let called = 0;
+    dev.onAuthorizationRequest((req: AuthorizationRequest) => {
+        called++;
+        req.verdict(true);
+    });
+    dev.setAuthorizationCache({ ttl: 60000 });
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+
+    for (let i = 0; i < 3; i++) {
+      let resp = await conn.createCoapRequest("GET", '/tcp-tunnels/services').execute();
+      expect(resp.getResponseStatusCode()).to.equal(205);
+    }
+    expect(called).to.equal(1);
+    expect(dev.getAuthorizationCacheStats()).to.deep.equal({ hits: 2, misses: 1, entries: 1 });
+
+    dev.clearAuthorizationCache();
+    expect(dev.getAuthorizationCacheStats()!.entries).to.equal(0);
+    await conn.createCoapRequest("GET", '/tcp-tunnels/services').execute();
+    expect(called).to.equal(2);
+  });
+
+  it('authorization cache pair then retry', async () => {
+    // IAM state kept in JS: only paired connections are allowed.
+    let paired = new Set<ConnectionRef>();
+    let lastRef: ConnectionRef | undefined;
+    let called = 0;
+    dev.onAuthorizationRequest((req: AuthorizationRequest) => {
+        called++;
+        lastRef = req.getConnectionRef();
+        req.verdict(paired.has(lastRef));
+    });
+    dev.setAuthorizationCache({ ttl: 60000 });
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+
+    for (let i = 0; i < 2; i++) {
+      let resp = await conn.createCoapRequest("GET", '/tcp-tunnels/services').execute();
+      expect(resp.getResponseStatusCode()).to.equal(403);
+    }
+    expect(called).to.equal(1);
+
+    // Pairing changes the state the callback decides on, so the cached deny must go.
+    paired.add(lastRef!);
+    dev.clearAuthorizationCache(lastRef);
+    let resp = await conn.createCoapRequest("GET", '/tcp-tunnels/services').execute();
+    expect(resp.getResponseStatusCode()).to.equal(205);
+    expect(called).to.equal(2);
+  });
+
+  it('coap endpoints next to tunnel endpoints', async () => {
+    dev.onAuthorizationRequest((req: AuthorizationRequest) => {
+        req.verdict(true);
+    });
+    // Same method and depths as the SDK's own tunnel endpoints.
+    dev.addCoapEndpoint(CoapMethod.GET, '/tcp-tunnels/status', (req: CoapRequest) => req.respond(205));
+    dev.addCoapEndpoint(CoapMethod.GET, '/things/{id}', (req: CoapRequest) => req.respond(203));
+    dev.addCoapEndpoint(CoapMethod.GET, '/things/{id}/{prop}', (req: CoapRequest) => req.respond(204));
+    dev.addTcpTunnelService("foo", "bar", "127.0.0.1", 8080);
+    await dev.start();
+    cli = NabtoClientFactory.create();
+    let key = cli.createPrivateKey();
+    conn = cli.createConnection();
+    conn.setOptions({ProductId: "pr-foobar", DeviceId: "de-foobar", Local: true, Remote: false, PrivateKey: key});
+    await conn.connect();
+
+    let status = await conn.createCoapRequest("GET", '/tcp-tunnels/status').execute();
+    expect(status.getResponseStatusCode()).to.equal(205);
+    let thing = await conn.createCoapRequest("GET", '/things/1').execute();
+    expect(thing.getResponseStatusCode()).to.equal(203);
+
+    // Requests for the SDK's endpoints still reach the SDK.
+    let services = await conn.createCoapRequest("GET", '/tcp-tunnels/services').execute();
+    expect(services.getResponseStatusCode()).to.equal(205);
+    expect(decode(Buffer.from(services.getResponsePayload()))).to.deep.equal(["foo"]);
+    let service = await conn.createCoapRequest("GET", '/tcp-tunnels/services/foo').execute();
+    expect(service.getResponseStatusCode()).to.equal(205);
+    expect(service.getResponseContentFormat()).to.equal(60);
+  });
+
   it('open tunnel', async () => {
     let port = randomInt(8000, 65000);
     let cliLocalPort = randomInt(8000, 65000);